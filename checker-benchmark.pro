@@ -0,0 +1,12 @@
+
+TEMPLATE = app
+
+include(checker.pri)
+
+macx*: CONFIG -= app_bundle
+    
+TARGET = checker-benchmark
+
+SOURCES += \
+	src/checker-benchmark.cpp
+
@@ -1,5 +1,5 @@
 
-CONFIG += qt stl c++11 exceptions console warn_on 
+CONFIG += qt stl c++11 exceptions console warn_on thread
 QT -= xml network gui widgets
 
 !win32 {
@@ -15,11 +15,28 @@ HEADERS += \
         checker/checkcode.h \
 	checker/plugincandidates.h \
 	checker/knownplugincandidates.h \
-	checker/knownplugins.h
+	checker/knownplugins.h \
+	checker/plugincatalog.h \
+	src/fileidentity.h \
+	src/verdictcache.h \
+	src/helperprotocol.h \
+	src/resultparser.h \
+	src/helperprocess.h \
+	src/directorywatcher.h \
+	src/ignorelist.h \
+	src/tracer.h
 
 SOURCES += \
 	src/plugincandidates.cpp \
 	src/knownplugincandidates.cpp \
-	src/knownplugins.cpp
+	src/knownplugins.cpp \
+	src/fileidentity.cpp \
+	src/verdictcache.cpp \
+	src/resultparser.cpp \
+	src/plugincatalog.cpp \
+	src/helperprocess.cpp \
+	src/directorywatcher.cpp \
+	src/ignorelist.cpp \
+	src/tracer.cpp
 
         
@@ -6,4 +6,9 @@ sub_checker_lib.file = checker-lib.pro
 sub_checker_client.file = checker-client.pro
 sub_helper.file = helper.pro
 
+!win32 {
+    SUBDIRS += sub_checker_benchmark
+    sub_checker_benchmark.file = checker-benchmark.pro
+}
+
 CONFIG += ordered
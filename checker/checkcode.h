@@ -49,7 +49,9 @@ enum class PluginCheckCode {
     /** Plugin library depends on some other library that cannot be
      *  loaded. On Windows this may arise from system error 126,
      *  ERROR_MOD_NOT_FOUND, provided that the library file itself
-     *  exists
+     *  exists. On Linux the helper reports this before loading the
+     *  library, if it can't find one of the libraries it names as
+     *  needed
      */
     FAIL_DEPENDENCY_MISSING = 3,
 
@@ -76,6 +78,19 @@ enum class PluginCheckCode {
      *  not attempted at all
      */
     FAIL_ON_IGNORE_LIST = 8,
+
+    /** Plugin library crashed the process that was checking it. The
+     *  message will usually identify the signal or exit code. This is
+     *  only reported by helpers running in fork-server mode, which
+     *  can survive the crash of a library they are checking
+     */
+    FAIL_CRASHED = 9,
+
+    /** Plugin library took longer than the permitted time to load
+     *  and enumerate its plugins, or its descriptor function went on
+     *  returning plugins past any plausible number of them
+     */
+    FAIL_TIMED_OUT = 10,
     
     /** Failure but no meaningful error code provided, or failure
      *  read from an older helper version that did not support
@@ -57,9 +57,37 @@ class KnownPluginCandidates
     typedef std::vector<std::string> stringlist;
     
 public:
+    /** Construct and scan all known plugin types. If resultCallback
+     *  is null, the scans are complete by the time the constructor
+     *  returns. Otherwise they run in the background, reporting each
+     *  library to resultCallback as it is checked, and the
+     *  constructor returns immediately; use waitForScans() or the
+     *  callback's scanFinished() to find out when they are done.
+     */
     KnownPluginCandidates(std::string helperExecutableName,
                           stringlist librariesToIgnore,
-                          PluginCandidates::LogCallback *cb = 0);
+                          PluginCandidates::LogCallback *cb = 0,
+                          PluginCandidates::Options options =
+                          PluginCandidates::Options(),
+                          PluginCandidates::ResultCallback *resultCallback = 0);
+
+    /** Cancel any background scans. See PluginCandidates::cancel().
+     */
+    void cancel() {
+        m_candidates.cancel();
+    }
+
+    /** Wait for any background scans to finish or be cancelled.
+     */
+    void waitForScans() {
+        m_candidates.waitForScans();
+    }
+
+    /** Return true if background scans are still in progress.
+     */
+    bool isScanning() const {
+        return m_candidates.isScanning();
+    }
     
     std::vector<KnownPlugins::PluginType> getKnownPluginTypes() const {
         return m_known.getKnownPluginTypes();
@@ -73,6 +101,35 @@ public:
         return m_candidates.getCandidateLibrariesFor(m_known.getTagFor(type));
     }
 
+    std::vector<PluginCandidates::PluginInfo>
+    getPluginsFor(KnownPlugins::PluginType type, std::string library) const {
+        return m_candidates.getPluginsFor(m_known.getTagFor(type), library);
+    }
+
+    /** Write a catalog of the scan results. See
+     *  PluginCandidates::writeCatalog().
+     */
+    bool writeCatalog(std::string filename) const {
+        return m_candidates.writeCatalog(filename);
+    }
+
+    /** Watch the directories of all known plugin types for
+     *  libraries being added, replaced or removed, checking only
+     *  those and reporting changes to the callback under each type's
+     *  tag. Call once the initial scans have finished. Returns false
+     *  if watching is not available. See PluginCandidates::watch().
+     */
+    bool watch(PluginCandidates::ChangeCallback *callback) {
+        return m_candidates.watch(getScanRequests(), callback);
+    }
+
+    /** Stop watching for changes. See
+     *  PluginCandidates::stopWatching().
+     */
+    void stopWatching() {
+        m_candidates.stopWatching();
+    }
+
     std::string getHelperExecutableName() const {
         return m_helperExecutableName;
     }
@@ -84,6 +141,8 @@ public:
     std::string getFailureReport() const;
     
 private:
+    std::vector<PluginCandidates::ScanRequest> getScanRequests() const;
+    
     KnownPlugins m_known;
     PluginCandidates m_candidates;
     std::string m_helperExecutableName;
@@ -34,10 +34,19 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <deque>
 
 #include "checkcode.h"
 
-class QProcess;
+class VerdictCache;
+class DirectoryWatcher;
+class IgnoreList;
+class Tracer;
+struct FileIdentity;
 
 /**
  * Class to identify and list candidate shared-library files possibly
@@ -54,11 +63,22 @@ class PluginCandidates
 
 public:
     /** Construct a PluginCandidates scanner that uses the given
-     *  executable as its load check helper.
+     *  executable as its load check helper. Libraries matching any
+     *  of librariesToIgnore are not checked, and are reported with
+     *  FAIL_ON_IGNORE_LIST. Each entry may be a library path, a
+     *  directory path ending in / to ignore everything below that
+     *  directory, or a library name with no / to ignore it wherever
+     *  it is found. Any path component may be a glob using *, ? and
+     *  [...], and a component of ** matches any number of
+     *  directories. The list is compiled once, here, and the cost of
+     *  matching against it does not grow with the number of literal
+     *  entries.
      */
     PluginCandidates(std::string helperExecutableName,
                      stringlist librariesToIgnore);
 
+    ~PluginCandidates();
+
     struct LogCallback {
         virtual ~LogCallback() { }
 
@@ -66,25 +86,274 @@ public:
         virtual void log(std::string) = 0;
     };
     
-    /** Set a callback to be called for log output.
+    /** Set a callback to be called for log output. The callback
+     *  may be called from more than one thread during a scan, but
+     *  calls to it are serialised.
      */
     void setLogCallback(LogCallback *cb);
 
+    /** Settings that affect how scan() runs the helper. By default
+     *  a single helper process is used per scan, but some defaults
+     *  do change how libraries are checked: each library is checked
+     *  in its own forked child process (useForkServer), is reported
+     *  as FAIL_TIMED_OUT if it takes longer than 5 seconds
+     *  (libraryTimeout), and a helper that grows beyond 1 GB is
+     *  replaced (helperMemoryLimit).
+     */
+    struct Options {
+        Options() :
+            helperPoolSize(1), useForkServer(true), libraryTimeout(5000),
+            directoryDepth(0), quarantineDays(7), keepHelpers(false),
+            helperLibraryLimit(1000), helperMemoryLimit(1024) { }
+
+        /// Maximum number of helper processes to run concurrently
+        /// during a scan. The libraries to be checked are split into
+        /// this many contiguous shards, each checked by its own
+        /// helper, and the results are merged back in the original
+        /// library order. The helpers are all driven from the thread
+        /// that runs the scan.
+        int helperPoolSize;
+
+        /// Path of a file in which to keep the verdicts from previous
+        /// scans. Libraries whose path, device, inode, size and
+        /// modification time are unchanged since a verdict was
+        /// recorded for the same descriptor symbol and helper version
+        /// are not checked again. The helper's own version is also
+        /// kept here, so if every verdict is cached the helper is
+        /// not run at all. Libraries that could not be loaded, or
+        /// whose dependencies were missing, are checked again on
+        /// every scan, as installing a dependency doesn't change the
+        /// library itself. Empty (the default) for no cache.
+        std::string cacheFile;
+
+        /// Ask the helper to check each library in its own forked
+        /// child process, so that a library that crashes is reported
+        /// as FAIL_CRASHED without ending the helper run. Ignored on
+        /// Windows, and with helpers older than v5.
+        bool useForkServer;
+
+        /// Time allowed for checking any single library, in ms. A
+        /// library that takes longer is reported as FAIL_TIMED_OUT.
+        /// Zero for no per-library limit. Not enforced with helpers
+        /// older than v6.
+        int libraryTimeout;
+
+        /// Number of levels of subdirectory to look for libraries in,
+        /// below each directory in the plugin path. Zero (the
+        /// default) to look only in the listed directories
+        /// themselves.
+        int directoryDepth;
+
+        /// Number of days for which a library that crashed or hung
+        /// the helper is not checked again, if it is unchanged. It
+        /// is reported with its earlier verdict instead. A library
+        /// that fails again when the quarantine expires is kept out
+        /// for longer each time, up to four times this period. Zero
+        /// to check such libraries on every scan; they are still
+        /// checked after all others, each in its own helper run if
+        /// the fork server is not in use. Requires cacheFile, in
+        /// which the crash history is kept.
+        int quarantineDays;
+
+        /// Keep helper processes running once they have checked the
+        /// libraries of a scan, up to helperPoolSize of them, and
+        /// give them the libraries of later scans rather than
+        /// starting new ones. A helper that crashes is replaced as
+        /// usual. The kept helpers are shut down when this object is
+        /// destroyed, or when the option is switched off. Ignored
+        /// with helpers older than v7.
+        bool keepHelpers;
+
+        /// With keepHelpers, the number of libraries a helper may
+        /// check before it is shut down and replaced by a fresh one,
+        /// so that whatever state the libraries leave behind in it
+        /// does not accumulate indefinitely. A helper is only
+        /// replaced between batches, so it may exceed this by up to
+        /// one batch. Zero for no limit.
+        int helperLibraryLimit;
+
+        /// Resident memory size, in megabytes, above which a helper
+        /// is replaced by a fresh one before it checks any further
+        /// libraries. Libraries that cannot be fully unloaded make a
+        /// helper grow as it works through a long list, unless the
+        /// fork server is in use. Zero for no limit. Linux only, and
+        /// not enforced with helpers older than v14.
+        int helperMemoryLimit;
+
+        /// Path of a file to which to write a timeline of each scan,
+        /// in the JSON trace event format that chrome://tracing and
+        /// Perfetto can display: directory listing, the helper
+        /// version query, each helper's lifetime, the span between
+        /// results for each library checked, restarts, and the time
+        /// spent waiting for and reading helper output. Helpers of
+        /// v16 or newer add the phases of each check from their own
+        /// side, by way of a second file alongside with ".helper"
+        /// appended to the name. The file is rewritten at the end of
+        /// each scan with everything recorded since the option was
+        /// set. Empty (the default) for no tracing, in which case
+        /// none of this costs anything.
+        std::string traceFile;
+    };
+
+    /** Set the options used by subsequent calls to scan(). Must
+     *  not be called while a scan is in progress.
+     */
+    void setOptions(Options options);
+
+    /** Return the options currently in use.
+     */
+    Options getOptions() const;
+
+    /** A plugin found in a library by its descriptor function.
+     */
+    struct PluginInfo {
+
+        /// Vamp plugin identifier, or LADSPA or DSSI plugin label
+        std::string identifier;
+
+        /// Plugin name, as given by the plugin
+        std::string name;
+
+        /// Vamp plugin version, or LADSPA or DSSI plugin UniqueID
+        int number;
+    };
+
+    struct ResultCallback {
+        virtual ~ResultCallback() { }
+
+        /// Called as soon as the result for a library is known. The
+        /// code is SUCCESS for a library that will be listed by
+        /// getCandidateLibrariesFor(tag). May be called from a thread
+        /// other than the one that started the scan, but calls are
+        /// serialised.
+        virtual void libraryChecked(std::string tag,
+                                    std::string library,
+                                    PluginCheckCode code,
+                                    std::string message) = 0;
+
+        /// Called once the scan for the given tag has ended, whether
+        /// because it completed or because it was cancelled.
+        virtual void scanFinished(std::string tag, bool cancelled) = 0;
+    };
+    
     /** Scan the libraries found in the given plugin path (i.e. list
      *  of plugin directories), checking that the given descriptor
      *  symbol can be looked up in each. Store the results
      *  internally, associated with the given (arbitrary) tag, for
      *  later querying using getCandidateLibrariesFor() and
-     *  getFailedLibrariesFor().
+     *  getFailedLibrariesFor(), replacing any from an earlier scan
+     *  with the same tag. If a result callback is provided, also
+     *  report each library's result to it as soon as it is known.
      *
-     *  Not thread-safe.
+     *  May be called from several threads at once, for example to
+     *  scan different plugin types side by side, provided that each
+     *  uses its own tags. The scans share the verdict cache, the
+     *  statistics and the stored results safely, and cancel()
+     *  applies to all of them.
      */
     void scan(std::string tag,
               stringlist pluginPath,
-              std::string descriptorSymbolName);
+              std::string descriptorSymbolName,
+              ResultCallback *callback = nullptr);
+
+    struct ScanRequest {
+        std::string tag;
+        stringlist pluginPath;
+        std::string descriptorSymbolName;
+    };
+
+    /** Carry out several scans, as for scan(), in a single pass. All
+     *  libraries are checked by one helper session (or one per pool
+     *  slot) and each library is loaded only once, however many of
+     *  the requests it is found for, with all of the relevant
+     *  descriptor symbols looked up in it together. Results are
+     *  stored under each request's tag as if it had been scanned
+     *  separately.
+     *
+     *  With helpers older than v7 the libraries are still gathered
+     *  up front, but each descriptor symbol needs its own helper
+     *  session.
+     */
+    void scan(std::vector<ScanRequest> requests,
+              ResultCallback *callback = nullptr);
+
+    /** Start a scan as for scan(), but in a background thread,
+     *  returning immediately. Results are reported to the callback
+     *  as they arrive, and are available from
+     *  getCandidateLibrariesFor() and getFailedLibrariesFor() once
+     *  the callback's scanFinished() has been called for the tag.
+     *  Further calls made while a scan is in progress are queued and
+     *  carried out in order.
+     */
+    void scanAsync(std::string tag,
+                   stringlist pluginPath,
+                   std::string descriptorSymbolName,
+                   ResultCallback *callback);
+
+    /** Start a scan as for scan() with a list of requests, but in a
+     *  background thread as for scanAsync().
+     */
+    void scanAsync(std::vector<ScanRequest> requests,
+                   ResultCallback *callback);
+
+    /** Cancel any scans in progress or queued. Any running helper is
+     *  killed, and results already received are kept. Returns
+     *  without waiting: call waitForScans() to be sure the scans
+     *  have stopped.
+     */
+    void cancel();
+
+    /** Wait until all scans started with scanAsync() have finished
+     *  or been cancelled.
+     */
+    void waitForScans();
+
+    /** Return true if any scan started with scanAsync() has not yet
+     *  finished.
+     */
+    bool isScanning() const;
+
+    struct ChangeCallback {
+        virtual ~ChangeCallback() { }
+
+        /// Called when a library has become a candidate for the
+        /// given tag, because it was added, or replaced by one that
+        /// passes its check. Called from the watcher's own thread.
+        virtual void libraryAdded(std::string tag,
+                                  std::string library) = 0;
+
+        /// Called when a library is no longer a candidate for the
+        /// given tag, because it was removed, or replaced by one that
+        /// fails its check. A library replaced by another that also
+        /// passes is reported as removed and then added again.
+        virtual void libraryRemoved(std::string tag,
+                                    std::string library) = 0;
+    };
+
+    /** Watch the directories in the plugin paths of the given
+     *  requests (as previously scanned) for libraries being added,
+     *  replaced or removed. Only the libraries that changed are
+     *  checked. The results for each request's tag are updated in
+     *  place, and changes to the candidate list are reported to the
+     *  callback. Directories in the plugin paths that don't exist
+     *  when this is called are not watched, but subdirectories
+     *  created within Options::directoryDepth of them later are.
+     *  Replaces any previous watch.
+     *
+     *  Only available on Linux: returns false elsewhere, or if none
+     *  of the directories could be watched.
+     */
+    bool watch(std::vector<ScanRequest> requests, ChangeCallback *callback);
+
+    /** Stop watching for changes, waiting for any check already
+     *  under way to finish. Must not be called from the
+     *  ChangeCallback.
+     */
+    void stopWatching();
 
     /** Return list of plugin library paths that were checked
-     *  successfully during the scan for the given tag.
+     *  successfully during the scan for the given tag. May be called
+     *  while an asynchronous scan is in progress.
      */
     stringlist getCandidateLibrariesFor(std::string tag) const;
     
@@ -105,18 +374,235 @@ public:
      */
     std::vector<FailureRec> getFailedLibrariesFor(std::string tag) const;
 
+    /** Return the plugins found in the given library by the scan for
+     *  the given tag, in descriptor index order, so that the host
+     *  need not load the library again to enumerate them. Empty if
+     *  the library was not a candidate, or if the helper is older
+     *  than v11 or has no knowledge of the descriptor function for
+     *  this tag (only Vamp, LADSPA and DSSI are known).
+     */
+    std::vector<PluginInfo> getPluginsFor(std::string tag,
+                                          std::string library) const;
+
+    /** Write the candidates and failures from all scans so far to a
+     *  catalog file, for PluginCatalog to map. Returns false if the
+     *  file could not be written.
+     */
+    bool writeCatalog(std::string filename) const;
+
+    /** Statistics gathered across all scans since construction or
+     *  the last call to resetStats(), for finding out where scan
+     *  time goes. All times are in microseconds.
+     */
+    struct Stats {
+
+        /// Time taken by each phase of checking one library, as
+        /// reported by the helper (v12 or newer). The lookup and walk
+        /// times are summed across the descriptors looked up in the
+        /// library.
+        struct LibraryTimes {
+            long long inspect;  ///< ELF pre-flight inspection
+            long long open;     ///< dlopen
+            long long lookup;   ///< dlsym of the descriptor functions
+            long long walk;     ///< calls to the descriptor functions
+            long long close;    ///< dlclose
+            long long total;    ///< whole check, including any fork
+        };
+
+        /// Memory left behind by checking one library, as reported by
+        /// the helper (v14 or newer, Linux only)
+        struct LibraryMemory {
+            long long residentGrowth; ///< bytes of resident set size
+            int mappingsLeft;         ///< extra mapped regions
+            bool stillMapped;         ///< library itself still mapped
+        };
+
+        Stats() : helperSpawns(0), helperRestarts(0), helperReuses(0),
+                  helperRecycles(0), bytesToHelper(0), bytesFromHelper(0) { }
+        
+        /// Phase times for each library the helper checked, keyed by
+        /// path. Libraries whose verdicts came from the cache, or
+        /// that were checked by an older helper, are not included.
+        /// If a library was checked more than once, the latest times
+        /// are kept.
+        std::map<std::string, LibraryTimes> libraries;
+
+        /// Memory left behind in the helper (or its fork-server child)
+        /// after loading and unloading each library it loaded, keyed
+        /// by path. A library that is still mapped after dlclose() is
+        /// one that a long-running helper cannot get rid of.
+        std::map<std::string, LibraryMemory> memory;
+
+        /// Number of helper processes started to check libraries
+        int helperSpawns;
+
+        /// Number of those that were started to carry on after a
+        /// previous helper exited before reporting on every library
+        int helperRestarts;
+
+        /// Number of times a helper kept from an earlier batch was
+        /// given more libraries to check, rather than a new one
+        /// being started (see Options::keepHelpers)
+        int helperReuses;
+
+        /// Number of helpers replaced because they had grown beyond
+        /// Options::helperMemoryLimit
+        int helperRecycles;
+
+        /// Bytes written to and read from helpers' standard I/O
+        long long bytesToHelper;
+        long long bytesFromHelper;
+
+        /// Wall time of the most recent scan for each tag. When
+        /// several tags are scanned in a single pass, each is given
+        /// the time of the whole pass.
+        std::map<std::string, long long> scanTimes;
+    };
+
+    /** Return the statistics gathered so far. May be called while an
+     *  asynchronous scan is in progress.
+     */
+    Stats getStats() const;
+
+    /** Discard the statistics gathered so far.
+     */
+    void resetStats();
+
 private:
     std::string m_helper;
     std::map<std::string, stringlist> m_candidates;
     std::map<std::string, std::vector<FailureRec> > m_failures;
-    std::set<std::string> m_toIgnore;
+    std::map<std::string,
+             std::map<std::string, std::vector<PluginInfo>>> m_plugins;
+    std::unique_ptr<IgnoreList> m_toIgnore;
     LogCallback *m_logCallback;
+    Options m_options;
+    std::mutex m_logMutex;
+    std::unique_ptr<VerdictCache> m_cache;
+    Stats m_stats;
+    std::unique_ptr<Tracer> m_tracer; // null unless tracing
+
+    // Guards m_cache, which concurrent scans share
+    std::mutex m_cacheMutex;
+    
+    // Guards m_stats, which concurrent scans update
+    mutable std::mutex m_statsMutex;
+
+    // Guards m_candidates, m_failures and m_plugins against
+    // concurrent queries
+    mutable std::mutex m_dataMutex;
 
-    stringlist getLibrariesInPath(stringlist path);
-    std::string getHelperCompatibilityVersion();
-    stringlist runHelper(stringlist libraries, std::string descriptor);
-    void recordResult(std::string tag, stringlist results);
-    void logErrors(QProcess *);
+    // Serialises ResultCallback calls from concurrent scans
+    std::mutex m_callbackMutex;
+
+    struct AsyncScan {
+        std::vector<ScanRequest> requests;
+        ResultCallback *callback;
+    };
+    std::deque<AsyncScan> m_asyncQueue;
+    std::thread m_asyncThread;
+    bool m_asyncRunning;
+    int m_scansRunning; // calls to scan() in progress, in any thread
+    mutable std::mutex m_asyncMutex;
+    std::atomic<bool> m_cancelled;
+
+    struct WatchListener;
+    std::unique_ptr<WatchListener> m_watchListener;
+    std::unique_ptr<DirectoryWatcher> m_watcher;
+    std::vector<ScanRequest> m_watchRequests;
+    struct WatchedDirectory {
+        // The requests whose paths include the directory
+        std::vector<size_t> requests;
+        // Levels of subdirectory below it that are also watched
+        int depth;
+        WatchedDirectory() : depth(0) { }
+    };
+    std::map<std::string, WatchedDirectory> m_watchedDirectories;
+    ChangeCallback *m_changeCallback;
+    // Guards m_watchRequests, m_watchedDirectories and
+    // m_changeCallback, which the watcher thread reads
+    std::mutex m_watchMutex;
+
+    // Idle helpers kept for later batches (Options::keepHelpers)
+    struct KeptHelper;
+    std::vector<std::unique_ptr<KeptHelper>> m_keptHelpers;
+    std::mutex m_keptHelpersMutex;
+    
+    struct Verdict {
+        PluginCheckCode code;
+        std::string message;
+        std::vector<PluginInfo> plugins;
+    };
+
+    // A single check is of one descriptor symbol in one library
+    typedef std::pair<std::string, std::string> CheckKey;
+    typedef std::map<CheckKey, Verdict> VerdictMap;
+    typedef std::vector<std::pair<CheckKey, Verdict>> VerdictList;
+
+    // One library to be loaded by the helper, with the descriptors
+    // to look up in it
+    struct Job {
+        std::string library;
+        stringlist descriptors;
+    };
+    
+    struct ScanContext {
+        // The tags that each check is being carried out for
+        std::map<CheckKey, stringlist> tags;
+        ResultCallback *callback;
+        // Compatibility version of the helper, as an integer
+        int helperVersion;
+    };
+
+    // Device and inode, where the platform has them
+    typedef std::pair<unsigned long long, unsigned long long> FileKey;
+    typedef std::vector<std::pair<std::string, FileIdentity>> Listing;
+    
+    std::vector<stringlist> getLibrariesInPaths
+    (std::vector<stringlist> paths, std::map<std::string, FileIdentity> &ids);
+    void checkLibraries(const std::vector<ScanRequest> &requests,
+                        const std::vector<stringlist> &libraryLists,
+                        std::map<std::string, FileIdentity> &ids,
+                        ResultCallback *callback, bool replaceTags);
+    void listSubdirectories(std::string dirname, int depth,
+                            std::set<FileKey> &visited,
+                            std::map<std::string, int> &dirs);
+    void librariesChanged(std::vector<std::pair<std::string, std::string>>
+                          changes, DirectoryWatcher *watcher);
+    std::set<std::string> forgetLibraries(std::string tag,
+                                          const std::set<std::string> &
+                                          libraries);
+    void listDirectory(std::string dirname, int depth,
+                       std::set<FileKey> &visited, Listing &listing);
+    std::string getHelperCompatibilityVersion(VerdictCache *cache);
+    std::string queryHelperCompatibilityVersion();
+    VerdictCache *getVerdictCache();
+    void runAsyncScans();
+    bool usingForkServer(const ScanContext &context) const;
+    VerdictList runJobs(std::vector<Job> jobs,
+                        const ScanContext &context);
+    VerdictList runHelperPoolPerDescriptor(std::vector<Job> jobs,
+                                           const ScanContext &context);
+    VerdictList runHelperPool(std::vector<Job> jobs,
+                              const ScanContext &context);
+    struct HelperRun;
+    void runHelpers(std::vector<HelperRun> &runs,
+                    const ScanContext &context);
+    void startHelper(HelperRun &run, const ScanContext &context);
+    void writeToHelper(HelperRun &run);
+    void readFromHelper(HelperRun &run, const ScanContext &context);
+    void finishHelper(HelperRun &run, const ScanContext &context);
+    void reportVerdict(const ScanContext &context, const std::string &tag,
+                       const std::string &library, const Verdict &verdict);
+    void reportVerdict(const ScanContext &context,
+                       const CheckKey &key, const Verdict &verdict);
+    void recordVerdict(const std::string &tag, const std::string &library,
+                       const Verdict &verdict);
+    void logErrors(HelperRun &run);
+    void keepHelper(HelperRun &run, const ScanContext &context);
+    void stopHelpers(std::vector<std::unique_ptr<KeptHelper>> helpers);
+    void stopKeptHelpers();
+    void writeTrace();
     void log(std::string);
 };
 
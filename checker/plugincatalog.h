@@ -0,0 +1,162 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#ifndef PLUGIN_CATALOG_H
+#define PLUGIN_CATALOG_H
+
+#include "checkcode.h"
+#include "plugincandidates.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+
+class QFile;
+
+/**
+ * Read-only view of a plugin catalog file, as written by
+ * PluginCandidates::writeCatalog() after a scan.
+ *
+ * The catalog holds the candidate libraries and failure records for
+ * each scanned tag. The file is memory-mapped rather than read, and
+ * its tables are laid out so that lookups by tag or by library path
+ * are binary searches directly on the mapped data. After open() has
+ * returned, no query parses anything or allocates memory, and
+ * several processes that open the same catalog share a single copy
+ * of it in the page cache.
+ *
+ * The format is specific to the byte order of the machine that wrote
+ * it, and open() refuses a catalog with the wrong byte order or
+ * format version. Strings returned are nul-terminated UTF-8, and
+ * remain valid until the catalog is closed.
+ *
+ * Not thread-safe with respect to open() and close(), but any number
+ * of threads may query an open catalog at once.
+ *
+ * Requires C++11 and the Qt5 QtCore library.
+ */
+class PluginCatalog
+{
+public:
+    PluginCatalog();
+    ~PluginCatalog();
+
+    /** Map and validate the given catalog file, closing any catalog
+     *  already open. Returns false if the file could not be mapped
+     *  or is not a valid catalog for this machine.
+     */
+    bool open(std::string filename);
+
+    /** Unmap the catalog. Any strings returned from it become
+     *  invalid.
+     */
+    void close();
+
+    /** Return true if a catalog is open.
+     */
+    bool isOpen() const;
+
+    /** Return the number of tags in the catalog.
+     */
+    int getTagCount() const;
+
+    /** Return the name of the tag with the given index. Tags are in
+     *  byte order of their names.
+     */
+    const char *getTagName(int tag) const;
+
+    /** Return the index of the tag with the given name, or -1 if it
+     *  is not in the catalog.
+     */
+    int findTag(const char *name) const;
+
+    /** Return the number of candidate libraries for the given tag.
+     */
+    int getCandidateCount(int tag) const;
+
+    /** Return the path of a candidate library for the given tag.
+     *  Candidates are in byte order of their paths.
+     */
+    const char *getCandidateLibrary(int tag, int index) const;
+
+    /** Return true if the given library is a candidate for the given
+     *  tag.
+     */
+    bool isCandidate(int tag, const char *library) const;
+
+    struct Failure {
+        const char *library;
+        PluginCheckCode code;
+        const char *message;
+    };
+
+    /** Return the number of failure records for the given tag.
+     */
+    int getFailureCount(int tag) const;
+
+    /** Return a failure record for the given tag. Failures are in
+     *  byte order of their library paths.
+     */
+    Failure getFailure(int tag, int index) const;
+
+    /** Look up the failure record for the given library under the
+     *  given tag. Returns true and sets failure if there is one.
+     */
+    bool findFailure(int tag, const char *library, Failure &failure) const;
+
+    typedef std::map<std::string, std::vector<std::string>> CandidateMap;
+
+    typedef std::map<std::string,
+                     std::vector<PluginCandidates::FailureRec>> FailureMap;
+
+    /** Write a catalog of the given candidates and failures, keyed by
+     *  tag, to the given file, replacing it atomically. Returns false
+     *  if the file could not be written.
+     */
+    static bool write(std::string filename,
+                      const CandidateMap &candidates,
+                      const FailureMap &failures);
+
+private:
+    std::unique_ptr<QFile> m_file;
+    const unsigned char *m_data;
+    size_t m_size;
+
+    PluginCatalog(const PluginCatalog &) = delete;
+    PluginCatalog &operator=(const PluginCatalog &) = delete;
+
+    const void *at(uint32_t offset) const { return m_data + offset; }
+    const char *stringAt(uint32_t index) const;
+    int findString(const char *s) const;
+    bool validate() const;
+};
+
+#endif
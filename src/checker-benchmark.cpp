@@ -0,0 +1,496 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+/**
+ * Benchmark for the scan path. Generates a synthetic corpus of plugin
+ * libraries -- valid Vamp, LADSPA and DSSI plugins mixed with
+ * libraries that have no plugins, lack a descriptor, have unresolved
+ * symbols or missing dependencies, crash or hang on load, or spam
+ * stdout and stderr -- and then times scans of it at a series of
+ * corpus sizes.
+ *
+ * Each kind of library is compiled once, using the C compiler named
+ * in $CC (default "cc"), and copied as many times as needed, so that
+ * every copy is a distinct file as far as the loader is concerned.
+ * Each scan is repeated several times after an untimed warm-up, and
+ * the minimum and median times are reported, which are much more
+ * stable from run to run than the mean.
+ *
+ * Unix only, as it relies on the compiler and fork-server mode.
+ */
+
+#include "knownplugincandidates.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+#ifndef _WIN32
+
+struct QuietLogCallback : PluginCandidates::LogCallback {
+    virtual void log(string) { }
+};
+
+struct LibraryKind {
+    const char *name;
+    int weight;         // relative share of the corpus
+    const char *source;
+    const char *flags;  // extra compiler flags
+};
+
+#define VAMP_DESCRIPTOR \
+    "typedef struct { unsigned int apiVersion; const char *identifier;\n" \
+    "  const char *name, *description, *maker; int pluginVersion; } D;\n"
+
+#define LADSPA_DESCRIPTOR \
+    "typedef struct { unsigned long UniqueID; const char *Label;\n" \
+    "  int Properties; const char *Name; } D;\n"
+
+static const LibraryKind libraryKinds[] = {
+    { "vamp", 30,
+      VAMP_DESCRIPTOR
+      "static const D d[] = { { 2, \"one\", \"One\", \"\", \"\", 1 },\n"
+      "                       { 2, \"two\", \"Two\", \"\", \"\", 1 } };\n"
+      "const void *vampGetPluginDescriptor(unsigned int v, unsigned int i)\n"
+      "{ return i < 2 ? &d[i] : 0; }\n", "" },
+    { "ladspa", 15,
+      LADSPA_DESCRIPTOR
+      "static const D d = { 1000, \"amp\", 0, \"Amplifier\" };\n"
+      "const void *ladspa_descriptor(unsigned long i)\n"
+      "{ return i < 1 ? &d : 0; }\n", "" },
+    { "dssi", 5,
+      LADSPA_DESCRIPTOR
+      "static const D d = { 1001, \"synth\", 0, \"Synth\" };\n"
+      "typedef struct { int version; const D *ladspa; } S;\n"
+      "static const S s = { 1, &d };\n"
+      "const void *dssi_descriptor(unsigned long i)\n"
+      "{ return i < 1 ? &s : 0; }\n"
+      "const void *ladspa_descriptor(unsigned long i)\n"
+      "{ return i < 1 ? &d : 0; }\n", "" },
+    { "noplugins", 10,
+      "const void *vampGetPluginDescriptor(unsigned int v, unsigned int i)\n"
+      "{ return 0; }\n", "" },
+    { "nodescriptor", 10,
+      "int notAPlugin(void) { return 0; }\n", "" },
+    { "unresolved", 5,
+      "extern int noSuchFunction(void);\n"
+      "int callIt(void) { return noSuchFunction(); }\n"
+      "const void *vampGetPluginDescriptor(unsigned int v, unsigned int i)\n"
+      "{ return 0; }\n", "" },
+    { "missingdep", 10,
+      "extern int benchmarkDep(void);\n"
+      "const void *vampGetPluginDescriptor(unsigned int v, unsigned int i)\n"
+      "{ benchmarkDep(); return 0; }\n",
+      "-L. -lbenchmarkdep" },
+    { "crash", 5,
+      "__attribute__((constructor)) static void crash(void)\n"
+      "{ *(volatile int *)0 = 0; }\n"
+      "const void *vampGetPluginDescriptor(unsigned int v, unsigned int i)\n"
+      "{ return 0; }\n", "" },
+    { "spam", 9,
+      "#include <stdio.h>\n"
+      VAMP_DESCRIPTOR
+      "static const D d = { 2, \"spam\", \"Spam\", \"\", \"\", 1 };\n"
+      "__attribute__((constructor)) static void spam(void) {\n"
+      "  int i; for (i = 0; i < 100; ++i) {\n"
+      "    printf(\"SUCCESS|/bogus|\\n\"); fprintf(stderr, \"noise\\n\"); } }\n"
+      "const void *vampGetPluginDescriptor(unsigned int v, unsigned int i)\n"
+      "{ return i < 1 ? &d : 0; }\n", "" },
+    { "hang", 1,
+      "#include <unistd.h>\n"
+      "__attribute__((constructor)) static void hang(void)\n"
+      "{ for (;;) sleep(1); }\n"
+      "const void *vampGetPluginDescriptor(unsigned int v, unsigned int i)\n"
+      "{ return 0; }\n", "" },
+};
+
+static const int kindCount = sizeof(libraryKinds) / sizeof(libraryKinds[0]);
+
+static bool
+run(string command)
+{
+    int rv = system(command.c_str());
+    if (rv != 0) {
+        cerr << "Command failed: " << command << endl;
+        return false;
+    }
+    return true;
+}
+
+static bool
+writeFile(string path, string contents)
+{
+    ofstream out(path.c_str(), ios::binary);
+    out << contents;
+    return bool(out);
+}
+
+static bool
+copyFile(string from, string to)
+{
+    ifstream in(from.c_str(), ios::binary);
+    ofstream out(to.c_str(), ios::binary);
+    out << in.rdbuf();
+    return bool(in) && bool(out);
+}
+
+// Compile one template library of each kind into dir
+static bool
+buildTemplates(string dir)
+{
+    const char *cc = getenv("CC");
+    string compiler = (cc && *cc) ? cc : "cc";
+    string build = "cd '" + dir + "' && " + compiler + " -shared -fPIC -O0 ";
+
+    // The dependency for "missingdep" exists only while building
+    if (!writeFile(dir + "/benchmarkdep.c",
+                   "int benchmarkDep(void) { return 0; }\n") ||
+        !run(build + "-o libbenchmarkdep.so benchmarkdep.c")) {
+        return false;
+    }
+    
+    for (int i = 0; i < kindCount; ++i) {
+        const LibraryKind &kind = libraryKinds[i];
+        string base = string("template-") + kind.name;
+        if (!writeFile(dir + "/" + base + ".c", kind.source) ||
+            !run(build + "-o " + base + ".so " + base + ".c " + kind.flags)) {
+            return false;
+        }
+    }
+    
+    unlink((dir + "/libbenchmarkdep.so").c_str());
+    return true;
+}
+
+// Fill dir with count libraries, in proportion to the kind weights,
+// interleaved so that every kind is spread across the whole scan
+static bool
+buildCorpus(string templates, string dir, int count, bool hangs)
+{
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        cerr << "Failed to create directory " << dir << endl;
+        return false;
+    }
+
+    vector<int> sequence;
+    for (int i = 0; i < kindCount; ++i) {
+        if (!hangs && string(libraryKinds[i].name) == "hang") continue;
+        for (int j = 0; j < libraryKinds[i].weight; ++j) {
+            sequence.push_back(i);
+        }
+    }
+    
+    for (int n = 0; n < count; ++n) {
+        // Stride through the sequence so that the rarer kinds are
+        // still reached in small corpora
+        const LibraryKind &kind =
+            libraryKinds[sequence[(size_t(n) * 37) % sequence.size()]];
+        char name[64];
+        snprintf(name, sizeof(name), "/lib%05d-%s.so", n, kind.name);
+        if (!copyFile(templates + "/template-" + kind.name + ".so",
+                      dir + name)) {
+            cerr << "Failed to write " << dir << name << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static double
+median(vector<double> v)
+{
+    sort(v.begin(), v.end());
+    size_t n = v.size();
+    return (n % 2) ? v[n/2] : (v[n/2 - 1] + v[n/2]) / 2.0;
+}
+
+struct Settings {
+    string helper;
+    string workDir;
+    vector<int> sizes;
+    int repeats;
+    PluginCandidates::Options options;
+    bool hangs;
+    bool check;
+};
+
+// Time one kind of scan over the corpus in dir, returning the
+// duration of each timed repeat in ms
+static vector<double>
+timeScans(const Settings &s, string dir, bool known,
+          PluginCandidates::Stats &stats)
+{
+    QuietLogCallback cb;
+    vector<double> times;
+    
+    for (int r = 0; r <= s.repeats; ++r) {
+        auto start = chrono::steady_clock::now();
+        if (known) {
+            KnownPluginCandidates kp(s.helper, {}, &cb, s.options);
+        } else {
+            PluginCandidates pc(s.helper, {});
+            pc.setLogCallback(&cb);
+            pc.setOptions(s.options);
+            pc.scan("vamp", { dir }, "vampGetPluginDescriptor");
+            stats = pc.getStats();
+        }
+        auto end = chrono::steady_clock::now();
+        if (r > 0) { // the first run is a warm-up
+            times.push_back(chrono::duration<double, milli>
+                            (end - start).count());
+        }
+    }
+
+    return times;
+}
+
+// Scan a small corpus in which a library that hangs and one that
+// crashes are each followed by a good library, with and without the
+// fork server, and check that each gets its own verdict: a helper
+// that reports a hang or crash and then exits must not have the
+// next library blamed for it
+static bool
+checkVerdicts(const Settings &s)
+{
+    struct Expected {
+        const char *kind;
+        PluginCheckCode code;
+    };
+    static const Expected expected[] = {
+        { "hang",  PluginCheckCode::FAIL_TIMED_OUT },
+        { "vamp",  PluginCheckCode::SUCCESS },
+        { "crash", PluginCheckCode::FAIL_CRASHED },
+        { "vamp",  PluginCheckCode::SUCCESS },
+    };
+
+    string dir = s.workDir + "/check";
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        cerr << "Failed to create directory " << dir << endl;
+        return false;
+    }
+    
+    vector<string> libraries;
+    for (const auto &e: expected) {
+        char name[64];
+        snprintf(name, sizeof(name), "/lib%05d-%s.so",
+                 int(libraries.size()), e.kind);
+        if (!copyFile(s.workDir + "/template-" + e.kind + ".so",
+                      dir + name)) {
+            cerr << "Failed to write " << dir << name << endl;
+            return false;
+        }
+        libraries.push_back(dir + name);
+    }
+
+    bool good = true;
+    
+    for (bool fork: { true, false }) {
+
+        QuietLogCallback cb;
+        PluginCandidates pc(s.helper, {});
+        pc.setLogCallback(&cb);
+        PluginCandidates::Options options = s.options;
+        options.useForkServer = fork;
+        pc.setOptions(options);
+        pc.scan("vamp", { dir }, "vampGetPluginDescriptor");
+
+        map<string, PluginCheckCode> codes;
+        for (const auto &library: pc.getCandidateLibrariesFor("vamp")) {
+            codes[library] = PluginCheckCode::SUCCESS;
+        }
+        for (const auto &f: pc.getFailedLibrariesFor("vamp")) {
+            codes[f.library] = f.code;
+        }
+
+        for (size_t i = 0; i < libraries.size(); ++i) {
+            auto ci = codes.find(libraries[i]);
+            bool match = (ci != codes.end() &&
+                          ci->second == expected[i].code);
+            cout << (fork ? "fork" : "in-process") << "\t"
+                 << libraries[i] << "\t";
+            if (ci == codes.end()) {
+                cout << "(no verdict)";
+            } else {
+                cout << "[" << int(ci->second) << "]";
+            }
+            cout << "\t" << (match ? "ok" : "WRONG") << endl;
+            if (!match) {
+                good = false;
+            }
+        }
+    }
+
+    return good;
+}
+
+static void
+usage(const char *name)
+{
+    cerr << "\nUsage: " << name << " [options]\n"
+        "\nGenerate a synthetic corpus of plugin libraries and time scans of it.\n"
+        "\nOptions:\n"
+        "  --helper <path>     Helper executable (default ./vamp-plugin-load-checker)\n"
+        "  --dir <path>        Directory for the corpus (default: a new temporary one)\n"
+        "  --sizes <n,...>     Corpus sizes to scan (default 10,100,1000,10000)\n"
+        "  --repeats <n>       Timed scans per size, after a warm-up (default 5)\n"
+        "  --pool <n>          Helper pool size (default 1)\n"
+        "  --timeout <ms>      Per-library timeout (default 500)\n"
+        "  --no-fork           Don't use fork-server mode\n"
+        "  --no-hang           Leave out the libraries that hang\n"
+        "  --check             Check the verdicts for a hang and a crash, each\n"
+        "                      followed by a good library, instead of timing\n"
+        "                      scans\n"
+        << endl;
+}
+
+int main(int argc, char **argv)
+{
+    Settings s;
+    s.helper = "./vamp-plugin-load-checker";
+    s.sizes = { 10, 100, 1000, 10000 };
+    s.repeats = 5;
+    s.options.libraryTimeout = 500;
+    s.hangs = true;
+    s.check = false;
+
+    for (int i = 1; i < argc; ++i) {
+        string opt = argv[i];
+        bool hasArg = (i + 1 < argc);
+        if (opt == "--helper" && hasArg) {
+            s.helper = argv[++i];
+        } else if (opt == "--dir" && hasArg) {
+            s.workDir = argv[++i];
+        } else if (opt == "--sizes" && hasArg) {
+            s.sizes.clear();
+            istringstream list(argv[++i]);
+            string size;
+            while (getline(list, size, ',')) {
+                s.sizes.push_back(atoi(size.c_str()));
+            }
+        } else if (opt == "--repeats" && hasArg) {
+            s.repeats = max(1, atoi(argv[++i]));
+        } else if (opt == "--pool" && hasArg) {
+            s.options.helperPoolSize = atoi(argv[++i]);
+        } else if (opt == "--timeout" && hasArg) {
+            s.options.libraryTimeout = atoi(argv[++i]);
+        } else if (opt == "--no-fork") {
+            s.options.useForkServer = false;
+        } else if (opt == "--no-hang") {
+            s.hangs = false;
+        } else if (opt == "--check") {
+            s.check = true;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (s.workDir == "") {
+        char tmpl[] = "/tmp/checker-benchmark-XXXXXX";
+        if (!mkdtemp(tmpl)) {
+            cerr << "Failed to create temporary directory" << endl;
+            return 1;
+        }
+        s.workDir = tmpl;
+    } else if (mkdir(s.workDir.c_str(), 0755) != 0 && errno != EEXIST) {
+        cerr << "Failed to create directory " << s.workDir << endl;
+        return 1;
+    }
+    
+    cerr << "Building corpus templates in " << s.workDir << endl;
+    if (!buildTemplates(s.workDir)) {
+        return 1;
+    }
+
+    if (s.check) {
+        return checkVerdicts(s) ? 0 : 1;
+    }
+
+    cout << "libraries\tscan\tmin ms\tmedian ms\tlibraries/s\t"
+         << "helper spawns\thelper restarts" << endl;
+    
+    for (int size: s.sizes) {
+
+        string dir = s.workDir + "/" + to_string(size);
+        if (!buildCorpus(s.workDir, dir, size, s.hangs)) {
+            return 1;
+        }
+
+        // Only the corpus for this size is on the plugin path. Every
+        // known type is scanned in the same directory.
+        setenv("VAMP_PATH", dir.c_str(), 1);
+        setenv("LADSPA_PATH", dir.c_str(), 1);
+        setenv("DSSI_PATH", dir.c_str(), 1);
+
+        for (bool known: { false, true }) {
+            PluginCandidates::Stats stats;
+            vector<double> times = timeScans(s, dir, known, stats);
+            double best = *min_element(times.begin(), times.end());
+            double mid = median(times);
+            cout << size << "\t"
+                 << (known ? "KnownPluginCandidates" : "PluginCandidates")
+                 << "\t" << best << "\t" << mid << "\t"
+                 << (mid > 0 ? int(size * 1000.0 / mid) : 0) << "\t";
+            if (known) {
+                cout << "-\t-";
+            } else {
+                cout << stats.helperSpawns << "\t" << stats.helperRestarts;
+            }
+            cout << endl;
+        }
+    }
+
+    return 0;
+}
+
+#else // _WIN32
+
+int main(int, char **)
+{
+    cerr << "The benchmark is not available on Windows" << endl;
+    return 1;
+}
+
+#endif
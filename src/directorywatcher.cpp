@@ -0,0 +1,241 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#include "directorywatcher.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#include <chrono>
+#include <set>
+#endif
+
+using namespace std;
+
+DirectoryWatcher::DirectoryWatcher(Listener *listener) :
+    m_listener(listener),
+    m_settleTime(0),
+    m_fd(-1)
+{
+    m_wake[0] = m_wake[1] = -1;
+}
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+    stop();
+}
+
+#ifdef __linux__
+
+bool
+DirectoryWatcher::isSupported()
+{
+    return true;
+}
+
+bool
+DirectoryWatcher::start(vector<string> directories, int settleTime)
+{
+    stop();
+    
+    m_settleTime = settleTime;
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd < 0) {
+        return false;
+    }
+
+    for (const auto &dir: directories) {
+        addDirectory(dir);
+    }
+
+    if (m_directories.empty() || pipe2(m_wake, O_CLOEXEC) != 0) {
+        ::close(m_fd);
+        m_fd = -1;
+        m_directories.clear();
+        return false;
+    }
+
+    m_thread = thread([this]() { run(); });
+    return true;
+}
+
+bool
+DirectoryWatcher::addDirectory(string directory)
+{
+    // Files written in place are reported when closed, and files
+    // moved into place (as package managers usually do) when moved.
+    // Creation is also included, for symlinks, which are never
+    // written, and for new subdirectories.
+    const uint32_t mask =
+        IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+        IN_DELETE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+    if (m_fd < 0) {
+        return false;
+    }
+    
+    // A directory already watched (perhaps by another name) gets
+    // the same watch descriptor back
+    int wd = inotify_add_watch(m_fd, directory.c_str(), mask);
+    if (wd < 0 || m_directories.find(wd) != m_directories.end()) {
+        return false;
+    }
+    m_directories[wd] = directory;
+    return true;
+}
+
+void
+DirectoryWatcher::stop()
+{
+    if (m_thread.joinable()) {
+        char c = 0;
+        while (::write(m_wake[1], &c, 1) < 0 && errno == EINTR);
+        m_thread.join();
+    }
+    for (int &fd: m_wake) {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    m_directories.clear();
+}
+
+void
+DirectoryWatcher::run()
+{
+    typedef chrono::steady_clock clock;
+    
+    set<pair<string, string>> pending;
+    clock::time_point lastChange;
+
+    // Big enough for a good many events, and aligned for them
+    alignas(struct inotify_event) char buffer[16384];
+
+    while (true) {
+
+        int timeout = -1;
+        if (!pending.empty()) {
+            auto settled = lastChange + chrono::milliseconds(m_settleTime);
+            auto left = chrono::duration_cast<chrono::milliseconds>
+                (settled - clock::now()).count();
+            timeout = int(max<long long>(0, left));
+        }
+
+        struct pollfd fds[2] = {
+            { m_fd, POLLIN, 0 },
+            { m_wake[0], POLLIN, 0 }
+        };
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            return;
+        }
+        if (fds[1].revents) {
+            return;
+        }
+
+        if (fds[0].revents) {
+            ssize_t n;
+            while ((n = ::read(m_fd, buffer, sizeof(buffer))) > 0) {
+                for (char *p = buffer; p < buffer + n; ) {
+                    const struct inotify_event *event =
+                        reinterpret_cast<struct inotify_event *>(p);
+                    p += sizeof(struct inotify_event) + event->len;
+
+                    if (event->mask & IN_Q_OVERFLOW) {
+                        // Events were lost: assume the worst
+                        for (const auto &d: m_directories) {
+                            pending.insert({ d.second, "" });
+                        }
+                        continue;
+                    }
+                    auto i = m_directories.find(event->wd);
+                    if (i == m_directories.end()) {
+                        continue;
+                    }
+                    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                        // Everything that was in it has gone
+                        pending.insert({ i->second, "" });
+                    } else if (event->mask & IN_IGNORED) {
+                        m_directories.erase(i);
+                    } else if (event->len > 0) {
+                        pending.insert({ i->second, string(event->name) });
+                    }
+                }
+                lastChange = clock::now();
+            }
+        }
+
+        if (!pending.empty() &&
+            clock::now() >= lastChange + chrono::milliseconds(m_settleTime)) {
+            vector<pair<string, string>> changes(pending.begin(),
+                                                 pending.end());
+            pending.clear();
+            m_listener->filesChanged(changes);
+        }
+    }
+}
+
+#else // !__linux__
+
+bool
+DirectoryWatcher::isSupported()
+{
+    return false;
+}
+
+bool
+DirectoryWatcher::start(vector<string>, int)
+{
+    return false;
+}
+
+bool
+DirectoryWatcher::addDirectory(string)
+{
+    return false;
+}
+
+void
+DirectoryWatcher::stop()
+{
+}
+
+void
+DirectoryWatcher::run()
+{
+}
+
+#endif
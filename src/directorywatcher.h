@@ -0,0 +1,111 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#ifndef DIRECTORY_WATCHER_H
+#define DIRECTORY_WATCHER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+
+/**
+ * Watches a set of directories for files being created, replaced or
+ * removed, and reports them in batches from a thread of its own once
+ * no further changes have arrived for a short settling time, so that
+ * a file is not reported while it is still being written.
+ *
+ * Implemented with inotify, and so only available on Linux.
+ */
+class DirectoryWatcher
+{
+public:
+    class Listener {
+    public:
+        virtual ~Listener() { }
+
+        /** Called from the watcher's thread with the files that have
+         *  changed, each as the directory (exactly as passed to
+         *  start() or addDirectory()) and the name of the file
+         *  within it. An empty name means that anything in the
+         *  directory may have changed, for example because events
+         *  were lost. A new subdirectory is reported by its name
+         *  within its parent, like a file.
+         */
+        virtual void filesChanged(std::vector<std::pair<std::string,
+                                                        std::string>>
+                                  changes) = 0;
+    };
+
+    DirectoryWatcher(Listener *listener);
+
+    /** Stop watching, waiting for any call to the listener to
+     *  return.
+     */
+    ~DirectoryWatcher();
+
+    /** Return true if watching is available on this platform.
+     */
+    static bool isSupported();
+    
+    /** Start watching the given directories, reporting changes once
+     *  none has arrived for settleTime ms. Directories that can't be
+     *  watched (for example because they don't exist) are skipped.
+     *  Returns false if none could be watched.
+     */
+    bool start(std::vector<std::string> directories, int settleTime);
+
+    /** Add a directory to those being watched, for example one that
+     *  has been created since start(). Must be called from the
+     *  listener, as the watcher's thread is the only one that uses
+     *  the directories. Returns true if the directory was not
+     *  already being watched and now is.
+     */
+    bool addDirectory(std::string directory);
+
+    /** Stop watching, waiting for any call to the listener to
+     *  return. Must not be called from the listener.
+     */
+    void stop();
+
+private:
+    DirectoryWatcher(const DirectoryWatcher &) = delete;
+    DirectoryWatcher &operator=(const DirectoryWatcher &) = delete;
+
+    void run();
+    
+    Listener *m_listener;
+    int m_settleTime;
+    int m_fd;
+    int m_wake[2];
+    std::map<int, std::string> m_directories; // by watch descriptor
+    std::thread m_thread;
+};
+
+#endif
@@ -0,0 +1,74 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#include "fileidentity.h"
+
+#ifdef _WIN32
+#include <QFileInfo>
+#include <QDateTime>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+FileIdentity
+FileIdentity::of(string path)
+{
+    FileIdentity id;
+    
+#ifdef _WIN32
+    // No inode numbers to speak of, so size and mtime will have to do
+    QFileInfo info(QString::fromUtf8(path.c_str()));
+    if (!info.exists()) {
+        return id;
+    }
+    id.valid = true;
+    id.size = info.size();
+    id.mtime = info.lastModified().toMSecsSinceEpoch() * 1000000LL;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return id;
+    }
+    id.valid = true;
+    id.device = st.st_dev;
+    id.inode = st.st_ino;
+    id.size = st.st_size;
+#ifdef __APPLE__
+    id.mtime = st.st_mtimespec.tv_sec * 1000000000LL +
+        st.st_mtimespec.tv_nsec;
+#else
+    id.mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+#endif
+
+    return id;
+}
@@ -0,0 +1,77 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#ifndef FILE_IDENTITY_H
+#define FILE_IDENTITY_H
+
+#include <string>
+
+/**
+ * The identity of a file on disk as far as the plugin checker is
+ * concerned: device and inode (where the platform has them), size,
+ * and modification time. Two FileIdentity objects that compare equal
+ * are taken to refer to the same unchanged file.
+ *
+ * Obtained with a single stat() call.
+ */
+struct FileIdentity
+{
+    FileIdentity() :
+        valid(false), device(0), inode(0), size(0), mtime(0) { }
+
+    /// False if the file could not be examined at all
+    bool valid;
+    
+    unsigned long long device;
+    unsigned long long inode;
+    unsigned long long size;
+
+    /// Modification time, in nanoseconds where available
+    long long mtime;
+
+    bool operator==(const FileIdentity &other) const {
+        return valid == other.valid &&
+            device == other.device &&
+            inode == other.inode &&
+            size == other.size &&
+            mtime == other.mtime;
+    }
+
+    bool operator!=(const FileIdentity &other) const {
+        return !(*this == other);
+    }
+    
+    /** Examine the file at the given (UTF-8) path and return its
+     *  identity. The returned object is not valid if the file does
+     *  not exist or cannot be examined.
+     */
+    static FileIdentity of(std::string path);
+};
+
+#endif
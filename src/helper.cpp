@@ -3,7 +3,7 @@
 /**
  * [Vamp] Plugin Load Checker
  *
- * This program accepts the name of a descriptor symbol as its only
+ * This program accepts the name of a descriptor symbol as its final
  * command-line argument. It then reads a list of plugin library paths
  * from stdin, one per line. For each path read, it attempts to load
  * that library and retrieve the named descriptor symbol, printing a
@@ -42,6 +42,125 @@
  * have been checked, this means that the plugin following the last
  * reported one has crashed. Typically the caller may want to run it
  * again, omitting that plugin.
+ *
+ * Options may precede the descriptor name:
+ *
+ * --fork  Check each library in a child process forked from this
+ *         one, after preloading some libraries that plugins commonly
+ *         depend on. A plugin that crashes then takes down only its
+ *         own child, and is reported with failure code FAIL_CRASHED
+ *         and a message naming the signal, after which checking
+ *         continues with the next library. Not available on Windows,
+ *         where the option is accepted but ignored. (Since v5.)
+ *
+ * --timeout <ms>
+ *         Allow at most this many milliseconds for checking each
+ *         library. A library that takes longer is reported with
+ *         failure code FAIL_TIMED_OUT. In fork-server mode the child
+ *         checking it is killed and checking continues with the next
+ *         library; otherwise the program reports the failure and
+ *         exits immediately. (Since v6.)
+ *
+ * The descriptor name argument may also be a comma-separated list of
+ * descriptor names, in which case each library is loaded once and
+ * every listed descriptor is looked up in it. An input line may also
+ * begin with its own comma-separated list of descriptor names
+ * followed by a | character, before the library path, to specify
+ * which descriptors to look up in that library in place of those
+ * given on the command line. In either case one output line is
+ * printed for each descriptor looked up, in the order in which the
+ * descriptors were listed. (Since v7.)
+ *
+ * Input is read until end of file, so the caller may keep the
+ * program running between batches of libraries, writing each batch
+ * as it comes and each line's descriptor list as described above.
+ * An input line consisting of |quit alone ends the program as end
+ * of file would. (Since v13.)
+ *
+ * --binary
+ *         Write results in the length-prefixed binary format
+ *         described in helperprotocol.h instead of as text lines,
+ *         one record per line that would otherwise have been
+ *         printed. (Since v8.)
+ *
+ * --plugin-info
+ *         Also report the plugins found by each successful descriptor
+ *         function, one line per plugin before the result line:
+ *
+ *         PLUGIN|/path/to/libname.so|number|identifier|name
+ *
+ *         where identifier and number are the Vamp plugin identifier
+ *         and version, or the LADSPA or DSSI plugin label and
+ *         UniqueID. In binary format each plugin is reported in a
+ *         record of kind Plugin. (Since v11.)
+ *
+ * --timings
+ *         Also report the time taken by each phase of checking, in
+ *         microseconds, in a line before each result line:
+ *
+ *         TIMINGS|/path/to/libname.so|inspect open lookup walk close total
+ *
+ *         being the ELF pre-flight inspection, dlopen, dlsym of the
+ *         descriptor, the walk through its plugins, dlclose, and the
+ *         whole check of the library including any fork. The
+ *         inspect, open, close and total times are for the library
+ *         as a whole, and are repeated for each descriptor. In binary
+ *         format these are reported in a record of kind Timings.
+ *         (Since v12.)
+ *
+ * --memory
+ *         Also report the memory use of the process checking each
+ *         library, in a line before each result line:
+ *
+ *         MEMORY|/path/to/libname.so|before after maps mapsafter mapped helper
+ *
+ *         being its resident set size in bytes before loading the
+ *         library and after unloading it, the number of regions
+ *         mapped into it at the same two points, 1 if the library
+ *         itself was still mapped after being unloaded (or 0 if
+ *         not), and the resident set size of this program after the
+ *         check. In fork-server mode the first five are for the
+ *         child process, so only the last shows the memory this
+ *         program is holding on to. In binary format these are
+ *         reported in a record of kind Memory. Linux only; accepted
+ *         but ignored elsewhere. (Since v14.)
+ *
+ * --result-fd <n>
+ *         Write results to file descriptor n, which the caller has
+ *         opened for this program to inherit, instead of to standard
+ *         output. Not available on Windows. (Since v15.)
+ *
+ * --trace <file>
+ *         Append events to the given file showing when each library
+ *         was checked and how long each phase of checking it took,
+ *         in the JSON trace event format that chrome://tracing and
+ *         Perfetto can display. A new file is started with the
+ *         opening bracket of a JSON array; each event is then
+ *         written on a line of its own, followed by a comma, so that
+ *         several helpers may append to the same file. Events are
+ *         timed by the system's monotonic clock, in microseconds.
+ *         Events from a fork-server child are shown as those of a
+ *         thread of this program. (Since v16.)
+ *
+ * Whichever descriptor results go to, standard output itself is sent
+ * to the null device for the whole run, so that nothing a plugin
+ * prints can get mixed up with them, and all the output for each
+ * library is written at once. (Since v15; earlier versions switched
+ * standard output on and off around each library.)
+ *
+ * Regardless of options, a descriptor function that goes on
+ * returning plugins beyond a fixed maximum index is taken to be
+ * broken and is reported with FAIL_TIMED_OUT, rather than looped
+ * over indefinitely.
+ *
+ * On Linux, each library's ELF headers are inspected before it is
+ * loaded, and one that is not a loadable ELF shared object for this
+ * architecture and CPU is rejected without being loaded. Descriptors
+ * that are not exported by the library are reported as missing
+ * without being looked up. (Since v9.) Its DT_NEEDED dependencies
+ * are then located in the way the dynamic loader would, and if any
+ * cannot be found, the library is rejected with FAIL_DEPENDENCY_MISSING
+ * listing all of them. (Since v10.)
  */
 
 /*
@@ -76,6 +195,8 @@
 
 #include "../checker/checkcode.h"
 
+#include "helperprotocol.h"
+
 static const char programName[] = "vamp-plugin-load-checker";
 
 #ifdef _WIN32
@@ -84,17 +205,63 @@ static const char programName[] = "vamp-plugin-load-checker";
 #include <io.h>
 #else
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <elf.h>
+#include <link.h>
+#endif
 #endif
 
 #include <signal.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
 
 #include <string>
 #include <iostream>
 #include <stdexcept>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 
 static std::string currentSoname = "";
 
+// Number of results due for the library being checked
+static size_t currentResultCount = 0;
+
+// Per-library time budget in ms, or 0 for none
+static int libraryTimeoutMs = 0;
+
+// Whether to write results in binary rather than text format
+static bool binaryOutput = false;
+
+// Whether to report the identity of each plugin found
+static bool reportPluginInfo = false;
+
+// Whether to report how long each phase of checking took
+static bool reportTimings = false;
+
+// Whether to report memory use around each check
+static bool reportMemory = false;
+
+// Descriptor functions returning more plugins than this are assumed
+// to be broken (e.g. ignoring the index and returning the same
+// descriptor forever)
+static const unsigned int maxDescriptorIndex = 100000;
+
 #ifdef _WIN32
 #ifndef UNICODE
 #error "This must be compiled with UNICODE defined"
@@ -206,34 +373,364 @@ string error()
     return DLERROR();
 }
 
+struct PluginInfo {
+    int number;
+    string identifier;
+    string name;
+};
+
+// Time spent in each phase of checking, in microseconds
+struct Timings {
+    long long inspect;
+    long long open;
+    long long lookup;
+    long long walk;
+    long long close;
+    long long total;
+};
+
+// Memory use of the process checking a library, sampled before
+// loading it and after unloading it, and of this program after the
+// check (which differs only in fork-server mode)
+struct Memory {
+    long long residentBefore;   // resident set size, in bytes
+    long long residentAfter;
+    long long mappingsBefore;   // number of mapped regions
+    long long mappingsAfter;
+    long long stillMapped;      // 1 if the library outlived dlclose
+    long long helperResident;
+};
+
+// The timings and memory use are zeroed until filled in
 struct Result {
+    Result() :
+        code(PluginCheckCode::SUCCESS), timings(), memory() { }
+    Result(PluginCheckCode c, string m) :
+        code(c), message(m), timings(), memory() { }
+
     PluginCheckCode code;
     string message;
+    vector<PluginInfo> plugins;
+    Timings timings;
+    Memory memory;
+};
+
+static long long monotonicUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// With --trace, events describing where the time goes are appended
+// to a file in the trace-event JSON format, one per line, timed by
+// the same monotonic clock as the caller uses for its own events.
+// Nothing is done towards them unless traceFd is open.
+
+static int traceFd = -1;
+
+// Our process ID, which fork-server children also give as the
+// process for their events, each then appearing as a thread of ours
+static long long tracePid = 0;
+
+static long long currentProcessId()
+{
+#ifdef _WIN32
+    return _getpid();
+#else
+    return getpid();
+#endif
+}
+
+static string jsonString(const string &s)
+{
+    string out = "\"";
+    for (unsigned char c: s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += char(c);
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += char(c);
+        }
+    }
+    return out + "\"";
+}
+
+static string traceArg(string name, string value)
+{
+    return jsonString(name) + ":" + jsonString(value);
+}
+
+static void writeTraceEvent(string event)
+{
+    // A single write per event, so that events from our children
+    // and from other helpers appending to the same file don't
+    // interleave
+    event += ",\n";
+#ifdef _WIN32
+    _write(traceFd, event.c_str(), unsigned(event.size()));
+#else
+    ssize_t n;
+    do {
+        n = write(traceFd, event.c_str(), event.size());
+    } while (n < 0 && errno == EINTR);
+#endif
+}
+
+static void traceSpan(const char *name, long long start, long long end,
+                      const string &args = string())
+{
+    if (traceFd < 0) return;
+    writeTraceEvent("{\"name\":" + jsonString(name) +
+                    ",\"ph\":\"X\",\"ts\":" + to_string(start) +
+                    ",\"dur\":" + to_string(end - start) +
+                    ",\"pid\":" + to_string(tracePid) +
+                    ",\"tid\":" + to_string(currentProcessId()) +
+                    ",\"args\":{" + args + "}}");
+}
+
+static void traceName(string kind, string name)
+{
+    if (traceFd < 0) return;
+    writeTraceEvent("{\"name\":\"" + kind + "\",\"ph\":\"M\"" +
+                    ",\"pid\":" + to_string(tracePid) +
+                    ",\"tid\":" + to_string(currentProcessId()) +
+                    ",\"args\":{" + traceArg("name", name) + "}}");
+}
+
+static bool openTrace(string filename)
+{
+#ifdef _WIN32
+    traceFd = _open(filename.c_str(),
+                    _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY,
+                    _S_IREAD | _S_IWRITE);
+#else
+    traceFd = open(filename.c_str(),
+                   O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+#endif
+    if (traceFd < 0) {
+        return false;
+    }
+    tracePid = currentProcessId();
+    // Start a new file as a JSON array, which trace viewers accept
+    // without the closing bracket
+#ifdef _WIN32
+    bool empty = (_lseek(traceFd, 0, SEEK_END) == 0);
+#else
+    bool empty = (lseek(traceFd, 0, SEEK_END) == 0);
+#endif
+    if (empty) {
+#ifdef _WIN32
+        _write(traceFd, "[\n", 2);
+#else
+        (void)!write(traceFd, "[\n", 2);
+#endif
+    }
+    string name = "helper " + to_string(tracePid);
+    traceName("process_name", name);
+    traceName("thread_name", name);
+    return true;
+}
+
+// The leading members of the plugin descriptor structures defined by
+// the Vamp, LADSPA and DSSI APIs, as far as we need them
+
+struct VampDescriptorHead {
+    unsigned int vampApiVersion;
+    const char *identifier;
+    const char *name;
+    const char *description;
+    const char *maker;
+    int pluginVersion;
+};
+
+struct LADSPADescriptorHead {
+    unsigned long UniqueID;
+    const char *Label;
+    int Properties;
+    const char *Name;
+};
+
+struct DSSIDescriptorHead {
+    int DSSI_API_Version;
+    const LADSPADescriptorHead *LADSPA_Plugin;
 };
 
-Result checkLADSPAStyleDescriptorFn(void *f)
+static string
+safeString(const char *s)
+{
+    return s ? s : "";
+}
+
+Result tooManyDescriptors()
+{
+    return { PluginCheckCode::FAIL_TIMED_OUT,
+             "Descriptor function returned more than " +
+             to_string(maxDescriptorIndex) + " plugins" };
+}
+
+// The descriptors are only looked into once the walk has ended
+// normally, so that a descriptor function that is already known to
+// be broken doesn't get the chance to crash us as well
+
+Result checkLADSPAStyleDescriptorFn(void *f, bool dssi)
 {
     typedef const void *(*DFn)(unsigned long);
     DFn fn = DFn(f);
-    unsigned long index = 0;
-    while (fn(index)) ++index;
-    if (index == 0) return { PluginCheckCode::FAIL_NO_PLUGINS, "" };
-    return { PluginCheckCode::SUCCESS, "" };
+    vector<const void *> descriptors;
+    const void *d = 0;
+    while (descriptors.size() < maxDescriptorIndex &&
+           (d = fn((unsigned long)descriptors.size()))) {
+        descriptors.push_back(d);
+    }
+    if (descriptors.empty()) return { PluginCheckCode::FAIL_NO_PLUGINS, "" };
+    if (descriptors.size() == maxDescriptorIndex) return tooManyDescriptors();
+    
+    Result result { PluginCheckCode::SUCCESS, "" };
+    for (size_t i = 0; reportPluginInfo && i < descriptors.size(); ++i) {
+        const LADSPADescriptorHead *ld = dssi ?
+            ((const DSSIDescriptorHead *)descriptors[i])->LADSPA_Plugin :
+            (const LADSPADescriptorHead *)descriptors[i];
+        if (ld) {
+            result.plugins.push_back({ int(ld->UniqueID),
+                                       safeString(ld->Label),
+                                       safeString(ld->Name) });
+        }
+    }
+    return result;
 }
 
 Result checkVampDescriptorFn(void *f)
 {
     typedef const void *(*DFn)(unsigned int, unsigned int);
     DFn fn = DFn(f);
-    unsigned int index = 0;
-    while (fn(2, index)) ++index;
-    if (index == 0) return { PluginCheckCode::FAIL_NO_PLUGINS, "" };
-    return { PluginCheckCode::SUCCESS, "" };
+    vector<const void *> descriptors;
+    const void *d = 0;
+    while (descriptors.size() < maxDescriptorIndex &&
+           (d = fn(2, (unsigned int)descriptors.size()))) {
+        descriptors.push_back(d);
+    }
+    if (descriptors.empty()) return { PluginCheckCode::FAIL_NO_PLUGINS, "" };
+    if (descriptors.size() == maxDescriptorIndex) return tooManyDescriptors();
+
+    Result result { PluginCheckCode::SUCCESS, "" };
+    for (size_t i = 0; reportPluginInfo && i < descriptors.size(); ++i) {
+        const VampDescriptorHead *vd =
+            (const VampDescriptorHead *)descriptors[i];
+        // We asked for API version 2, so anything else is not a
+        // descriptor we can read
+        if (vd->vampApiVersion < 1 || vd->vampApiVersion > 2) {
+            continue;
+        }
+        result.plugins.push_back({ vd->pluginVersion,
+                                   safeString(vd->identifier),
+                                   safeString(vd->name) });
+    }
+    return result;
+}
+
+typedef vector<Result> Results;
+
+static string formatRecord(HelperRecordKind kind, int code,
+                           string soname, string message)
+{
+    HelperRecordHeader header;
+    header.kind = uint32_t(kind);
+    header.code = int32_t(code);
+    header.pathLength = uint32_t(soname.size());
+    header.messageLength = uint32_t(message.size());
+    return string((const char *)&header, sizeof(header)) + soname + message;
+}
+
+static string replaceLineBreaks(string s)
+{
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '\n' || s[i] == '\r') {
+            s[i] = ' ';
+        }
+    }
+    return s;
+}
+
+// Return the output to be written for one result, in either text or
+// binary format, preceded by any plugin, timing and memory reports
+static string formatResult(string soname, Result result)
+{
+    string preamble;
+    for (const auto &p: result.plugins) {
+        if (binaryOutput) {
+            preamble += formatRecord(HelperRecordKind::Plugin, p.number,
+                                     soname, p.identifier + '\0' + p.name);
+        } else {
+            string identifier = p.identifier;
+            replace(identifier.begin(), identifier.end(), '|', ' ');
+            preamble += "PLUGIN|" + soname + "|" + to_string(p.number) +
+                "|" + replaceLineBreaks(identifier) + "|" +
+                replaceLineBreaks(p.name) + "\n";
+        }
+    }
+    
+    if (reportTimings) {
+        const Timings &t = result.timings;
+        if (binaryOutput) {
+            HelperTimings ht { t.inspect, t.open, t.lookup,
+                               t.walk, t.close, t.total };
+            preamble += formatRecord(HelperRecordKind::Timings, 0, soname,
+                                     string((const char *)&ht, sizeof(ht)));
+        } else {
+            preamble += "TIMINGS|" + soname + "|" +
+                to_string(t.inspect) + " " + to_string(t.open) + " " +
+                to_string(t.lookup) + " " + to_string(t.walk) + " " +
+                to_string(t.close) + " " + to_string(t.total) + "\n";
+        }
+    }
+
+#ifdef __linux__
+    if (reportMemory) {
+        const Memory &m = result.memory;
+        if (binaryOutput) {
+            HelperMemory hm { m.residentBefore, m.residentAfter,
+                              m.mappingsBefore, m.mappingsAfter,
+                              m.stillMapped, m.helperResident };
+            preamble += formatRecord(HelperRecordKind::Memory, 0, soname,
+                                     string((const char *)&hm, sizeof(hm)));
+        } else {
+            preamble += "MEMORY|" + soname + "|" +
+                to_string(m.residentBefore) + " " +
+                to_string(m.residentAfter) + " " +
+                to_string(m.mappingsBefore) + " " +
+                to_string(m.mappingsAfter) + " " +
+                to_string(m.stillMapped) + " " +
+                to_string(m.helperResident) + "\n";
+        }
+    }
+#endif
+    
+    if (binaryOutput) {
+        return preamble +
+            formatRecord(HelperRecordKind::Result, int(result.code), soname,
+                         result.message);
+    }
+    
+    if (result.code == PluginCheckCode::SUCCESS) {
+        return preamble + "SUCCESS|" + soname + "|\n";
+    }
+
+    string codeText = "[" + to_string(int(result.code)) + "]";
+    if (result.message == "") {
+        return preamble + "FAILURE|" + soname + "|" + codeText + "\n";
+    }
+    
+    return preamble + "FAILURE|" + soname + "|" +
+        replaceLineBreaks(result.message) + " " + codeText + "\n";
 }
 
-Result check(string soname, string descriptor)
+Result openLibrary(string soname, void *&handle)
 {
-    void *handle = DLOPEN(soname, RTLD_NOW | RTLD_LOCAL);
+    handle = DLOPEN(soname, RTLD_NOW | RTLD_LOCAL);
     if (!handle) {
         PluginCheckCode code = PluginCheckCode::FAIL_NOT_LOADABLE;
         string message = error();
@@ -269,15 +766,23 @@ Result check(string soname, string descriptor)
         return { code, message };
     }
 
+    return { PluginCheckCode::SUCCESS, "" };
+}
+
+Result checkDescriptor(void *handle, string descriptor)
+{
     Result result { PluginCheckCode::SUCCESS, "" };
 
+    long long start = monotonicUs();
     void *fn = DLSYM(handle, descriptor);
+    long long lookup = monotonicUs() - start;
+    
     if (!fn) {
         result = { PluginCheckCode::FAIL_DESCRIPTOR_MISSING, error() };
     } else if (descriptor == "ladspa_descriptor") {
-        result = checkLADSPAStyleDescriptorFn(fn);
+        result = checkLADSPAStyleDescriptorFn(fn, false);
     } else if (descriptor == "dssi_descriptor") {
-        result = checkLADSPAStyleDescriptorFn(fn);
+        result = checkLADSPAStyleDescriptorFn(fn, true);
     } else if (descriptor == "vampGetPluginDescriptor") {
         result = checkVampDescriptorFn(fn);
     } else {
@@ -285,144 +790,1722 @@ Result check(string soname, string descriptor)
              << descriptor << "\"; not actually calling it" << endl;
     }
 
+    long long end = monotonicUs();
+    result.timings.lookup = lookup;
+    if (fn) {
+        result.timings.walk = end - start - lookup;
+    }
+    if (traceFd >= 0) {
+        traceSpan("descriptor", start, end,
+                  traceArg("descriptor", descriptor) + "," +
+                  traceArg("code", to_string(int(result.code))));
+    }
+    return result;
+}
+
+static Results checkUnmeasured(string soname,
+                               const vector<string> &descriptors)
+{
+    void *handle = 0;
+    long long start = monotonicUs();
+    Result opened = openLibrary(soname, handle);
+    opened.timings.open = monotonicUs() - start;
+    if (traceFd >= 0) {
+        traceSpan("dlopen", start, start + opened.timings.open,
+                  traceArg("library", soname) + "," +
+                  traceArg("code", to_string(int(opened.code))));
+    }
+    if (!handle) {
+        return Results(descriptors.size(), opened);
+    }
+
+    Results results;
+    for (size_t i = 0; i < descriptors.size(); ++i) {
+        results.push_back(checkDescriptor(handle, descriptors[i]));
+        results[i].timings.open = opened.timings.open;
+    }
+
+    start = monotonicUs();
     DLCLOSE(handle);
+    long long closing = monotonicUs() - start;
+    traceSpan("dlclose", start, start + closing);
     
-    return result;
+    for (auto &r: results) {
+        r.timings.close = closing;
+    }
+    return results;
 }
 
-// We write our output to stdout, but want to ensure that the plugin
-// doesn't write anything itself. To do this we open a null file
-// descriptor and dup2() it into place of stdout in the gaps between
-// our own output activity.
+#ifdef __linux__
 
-static int normalFd = -1;
-static int suspendedFd = -1;
+// Resident set size of this process in bytes, from /proc/self/statm,
+// or -1 if it can't be read
+static long long residentBytes()
+{
+    ifstream statm("/proc/self/statm");
+    long long size = 0, resident = -1;
+    if (!(statm >> size >> resident)) {
+        return -1;
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
 
-static void initFds()
+// Number of regions mapped into this process, from /proc/self/maps,
+// or -1 if it can't be read. Sets mapped if any of them is of the
+// file with the given device and inode.
+static long long countMappings(dev_t dev, ino_t ino, bool &mapped)
 {
-#ifdef _WIN32
-    normalFd = _dup(1);
-    suspendedFd = _open("NUL", _O_WRONLY);
-#else
-    normalFd = dup(1);
-    suspendedFd = open("/dev/null", O_WRONLY);
+    mapped = false;
+    ifstream maps("/proc/self/maps");
+    if (!maps) {
+        return -1;
+    }
+    long long count = 0;
+    string line;
+    while (getline(maps, line)) {
+        ++count;
+        unsigned int major = 0, minor = 0;
+        unsigned long long inode = 0;
+        if (ino != 0 &&
+            sscanf(line.c_str(), "%*s %*s %*s %x:%x %llu",
+                   &major, &minor, &inode) == 3 &&
+            inode == ino && makedev(major, minor) == dev) {
+            mapped = true;
+        }
+    }
+    return count;
+}
+
+#endif
+
+Results check(string soname, const vector<string> &descriptors)
+{
+#ifdef __linux__
+    struct stat st;
+    if (!reportMemory || stat(soname.c_str(), &st) != 0) {
+        st.st_dev = 0;
+        st.st_ino = 0;
+    }
+    bool mapped = false;
+    long long residentBefore = 0, mappingsBefore = 0;
+    if (reportMemory) {
+        residentBefore = residentBytes();
+        mappingsBefore = countMappings(st.st_dev, st.st_ino, mapped);
+    }
 #endif
     
-    if (normalFd < 0 || suspendedFd < 0) {
-        throw std::runtime_error
-            ("Failed to initialise fds for stdio suspend/resume");
+    Results results = checkUnmeasured(soname, descriptors);
+
+#ifdef __linux__
+    if (reportMemory) {
+        long long residentAfter = residentBytes();
+        long long mappingsAfter = countMappings(st.st_dev, st.st_ino, mapped);
+        for (auto &r: results) {
+            r.memory.residentBefore = residentBefore;
+            r.memory.residentAfter = residentAfter;
+            r.memory.mappingsBefore = mappingsBefore;
+            r.memory.mappingsAfter = mappingsAfter;
+            r.memory.stillMapped = (mapped ? 1 : 0);
+        }
     }
+#endif
+
+    return results;
 }
 
-static void suspendOutput()
-{
-#ifdef _WIN32
-    _dup2(suspendedFd, 1);
+#ifdef __linux__
+
+// Pre-flight inspection of ELF libraries. Before a library is handed
+// to dlopen(), which maps its dependencies, relocates it and runs its
+// static constructors, its headers are read directly from a
+// read-only mapping of the file in order to rule out the cases that
+// would fail anyway: files that are empty or not ELF at all,
+// libraries built for another architecture or needing a newer x86
+// ISA level than this CPU has, and libraries that don't export a
+// given descriptor symbol. None of the library's own code is run,
+// and anything that can't be read with confidence is left for
+// dlopen() to judge.
+//
+// The descriptor lookup only considers the library's own dynamic
+// symbol table, so a descriptor function defined in one of its
+// dependencies would not be found -- plugin formats expect the
+// library itself to export it.
+
+#if defined(__x86_64__)
+#define NATIVE_ELF_MACHINE EM_X86_64
+#elif defined(__i386__)
+#define NATIVE_ELF_MACHINE EM_386
+#elif defined(__aarch64__)
+#define NATIVE_ELF_MACHINE EM_AARCH64
+#elif defined(__arm__)
+#define NATIVE_ELF_MACHINE EM_ARM
+#elif defined(__powerpc64__)
+#define NATIVE_ELF_MACHINE EM_PPC64
+#elif defined(__powerpc__)
+#define NATIVE_ELF_MACHINE EM_PPC
+#endif
+
+#if __ELF_NATIVE_CLASS == 64
+#define NATIVE_ELF_CLASS ELFCLASS64
 #else
-    dup2(suspendedFd, 1);
+#define NATIVE_ELF_CLASS ELFCLASS32
 #endif
-}
 
-static void resumeOutput()
-{
-    fflush(stdout);
-#ifdef _WIN32
-    _dup2(normalFd, 1);
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define NATIVE_ELF_DATA ELFDATA2LSB
 #else
-    dup2(normalFd, 1);
+#define NATIVE_ELF_DATA ELFDATA2MSB
 #endif
-}
 
-static void
-signalHandler(int signal)
-{
-    cerr << "Signal " << signal << " caught" << endl;
-    cout << "FAILURE|" << currentSoname << "|[" << int(PluginCheckCode::FAIL_NOT_LOADABLE) << "]" << endl;
-    exit(1);
-}
+#ifndef NT_GNU_PROPERTY_TYPE_0
+#define NT_GNU_PROPERTY_TYPE_0 5
+#endif
+#ifndef GNU_PROPERTY_X86_ISA_1_NEEDED
+#define GNU_PROPERTY_X86_ISA_1_NEEDED 0xc0008002
+#endif
 
-int main(int argc, char **argv)
+class ElfImage
 {
-    bool allGood = true;
-    string soname;
+public:
+    ElfImage(const unsigned char *data, size_t size) :
+        m_data(data), m_size(size) { }
 
-    bool showUsage = false;
-    
-    if (argc > 1) {
-        string opt = argv[1];
-        if (opt == "-?" || opt == "-h" || opt == "--help") {
-            showUsage = true;
-        } else if (opt == "-v" || opt == "--version") {
-            cout << CHECKER_COMPATIBILITY_VERSION << endl;
+    // Return a pointer to count objects of type T at the given file
+    // offset, or null if they would extend past the end of the file
+    // or be misaligned
+    template <typename T>
+    const T *at(size_t offset, size_t count = 1) const {
+        if (offset > m_size ||
+            count > (m_size - offset) / sizeof(T) ||
+            (uintptr_t(m_data + offset) % alignof(T)) != 0) {
             return 0;
         }
-    } 
+        return (const T *)(m_data + offset);
+    }
+
+    // Return the file offset corresponding to a virtual address, or
+    // 0 if it isn't in any loaded segment
+    size_t offsetOf(ElfW(Addr) addr) const {
+        const ElfW(Ehdr) *eh = at<ElfW(Ehdr)>(0);
+        const ElfW(Phdr) *ph = at<ElfW(Phdr)>(eh->e_phoff, eh->e_phnum);
+        if (!ph) return 0;
+        for (int i = 0; i < eh->e_phnum; ++i) {
+            if (ph[i].p_type == PT_LOAD &&
+                addr >= ph[i].p_vaddr &&
+                addr - ph[i].p_vaddr < ph[i].p_filesz) {
+                return ph[i].p_offset + (addr - ph[i].p_vaddr);
+            }
+        }
+        return 0;
+    }
+
+    const char *string(size_t offset) const {
+        if (offset >= m_size) return 0;
+        const char *s = (const char *)m_data + offset;
+        if (!memchr(s, '\0', m_size - offset)) return 0;
+        return s;
+    }
     
-    if (argc != 2 || showUsage) {
-        cerr << endl;
-        cerr << programName << ": Test shared library objects for plugins to be" << endl;
-        cerr << "loaded via descriptor functions." << endl;
-        cerr << "\n    Usage: " << programName << " <descriptorname>\n"
-            "\nwhere descriptorname is the name of a plugin descriptor symbol to be sought\n"
-            "in each library (e.g. vampGetPluginDescriptor for Vamp plugins). The list of\n"
-            "candidate plugin library filenames is read from stdin.\n" << endl;
-        return 2;
+private:
+    const unsigned char *m_data;
+    size_t m_size;
+};
+
+struct DynamicSymbols {
+    DynamicSymbols() :
+        symtab(0), strtab(0), strsz(0), gnuHash(0), sysvHash(0) { }
+    size_t symtab;
+    size_t strtab;
+    size_t strsz;
+    size_t gnuHash;
+    size_t sysvHash;
+};
+
+enum class SymbolLookup { Found, Missing, Unknown };
+
+static bool
+isDefinedSymbolNamed(const ElfImage &image, const DynamicSymbols &dyn,
+                     size_t index, const char *name, bool &readable)
+{
+    const ElfW(Sym) *sym = image.at<ElfW(Sym)>
+        (dyn.symtab + index * sizeof(ElfW(Sym)));
+    if (!sym || sym->st_name >= dyn.strsz) {
+        readable = false;
+        return false;
+    }
+    const char *symName = image.string(dyn.strtab + sym->st_name);
+    if (!symName) {
+        readable = false;
+        return false;
     }
+    int bind = ELF32_ST_BIND(sym->st_info);
+    return strcmp(symName, name) == 0 &&
+        sym->st_shndx != SHN_UNDEF &&
+        (bind == STB_GLOBAL || bind == STB_WEAK || bind == STB_GNU_UNIQUE);
+}
 
-    signal(SIGINT,  signalHandler);
-    signal(SIGTERM, signalHandler);
-    signal(SIGSEGV, signalHandler);
-    signal(SIGILL,  signalHandler);
-    signal(SIGABRT, signalHandler);
-    signal(SIGFPE,  signalHandler);
+static SymbolLookup
+lookupGnuHash(const ElfImage &image, const DynamicSymbols &dyn,
+              const char *name)
+{
+    const uint32_t *header = image.at<uint32_t>(dyn.gnuHash, 4);
+    if (!header) return SymbolLookup::Unknown;
+    uint32_t nbuckets = header[0];
+    uint32_t symoffset = header[1];
+    uint32_t bloomSize = header[2];
+    uint32_t bloomShift = header[3];
+    if (nbuckets == 0 || bloomSize == 0) return SymbolLookup::Unknown;
 
-#ifndef _WIN32
-    signal(SIGHUP,  signalHandler);
-    signal(SIGQUIT, signalHandler);
-    signal(SIGBUS,  signalHandler);
-#endif
+    size_t bloomOffset = dyn.gnuHash + 4 * sizeof(uint32_t);
+    const ElfW(Addr) *bloom = image.at<ElfW(Addr)>(bloomOffset, bloomSize);
+    size_t bucketOffset = bloomOffset + bloomSize * sizeof(ElfW(Addr));
+    const uint32_t *buckets = image.at<uint32_t>(bucketOffset, nbuckets);
+    size_t chainOffset = bucketOffset + nbuckets * sizeof(uint32_t);
+    if (!bloom || !buckets) return SymbolLookup::Unknown;
 
-    string descriptor = argv[1];
-    
-#ifdef _WIN32
-    // Avoid showing the error-handler dialog for missing DLLs,
-    // failing quietly instead. It's permissible for this program
-    // to simply fail when a DLL can't be loaded -- showing the
-    // error dialog wouldn't change this anyway, it would just
-    // block the program until the user clicked it away and then
-    // fail anyway.
-    SetErrorMode(SEM_FAILCRITICALERRORS);
-#endif
+    uint32_t h = 5381;
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p) {
+        h = h * 33 + *p;
+    }
 
-    initFds();
-    suspendOutput();
-    
-    while (getline(cin, soname)) {
+    const unsigned int bits = sizeof(ElfW(Addr)) * 8;
+    ElfW(Addr) word = bloom[(h / bits) % bloomSize];
+    ElfW(Addr) mask =
+        (ElfW(Addr)(1) << (h % bits)) |
+        (ElfW(Addr)(1) << ((h >> bloomShift) % bits));
+    if ((word & mask) != mask) {
+        return SymbolLookup::Missing;
+    }
 
-        currentSoname = soname;
+    uint32_t index = buckets[h % nbuckets];
+    if (index == 0) return SymbolLookup::Missing;
+    if (index < symoffset) return SymbolLookup::Unknown;
 
-        Result result = check(soname, descriptor);
-        resumeOutput();
-        if (result.code == PluginCheckCode::SUCCESS) {
-            cout << "SUCCESS|" << soname << "|" << endl;
-        } else {
-            if (result.message == "") {
-                cout << "FAILURE|" << soname
-                     << "|[" << int(result.code) << "]" << endl;
-            } else {
-                for (size_t i = 0; i < result.message.size(); ++i) {
-                    if (result.message[i] == '\n' ||
-                        result.message[i] == '\r') {
-                        result.message[i] = ' ';
-                    }
+    while (true) {
+        const uint32_t *chain = image.at<uint32_t>
+            (chainOffset + (index - symoffset) * sizeof(uint32_t));
+        if (!chain) return SymbolLookup::Unknown;
+        if ((*chain | 1) == (h | 1)) {
+            bool readable = true;
+            if (isDefinedSymbolNamed(image, dyn, index, name, readable)) {
+                return SymbolLookup::Found;
+            }
+            if (!readable) return SymbolLookup::Unknown;
+        }
+        if (*chain & 1) break;
+        ++index;
+    }
+    
+    return SymbolLookup::Missing;
+}
+
+static SymbolLookup
+lookupSysvHash(const ElfImage &image, const DynamicSymbols &dyn,
+               const char *name)
+{
+    const uint32_t *header = image.at<uint32_t>(dyn.sysvHash, 2);
+    if (!header) return SymbolLookup::Unknown;
+    uint32_t nbucket = header[0];
+    uint32_t nchain = header[1];
+    if (nbucket == 0) return SymbolLookup::Unknown;
+    const uint32_t *buckets = image.at<uint32_t>
+        (dyn.sysvHash + 2 * sizeof(uint32_t), nbucket);
+    const uint32_t *chains = image.at<uint32_t>
+        (dyn.sysvHash + (2 + nbucket) * sizeof(uint32_t), nchain);
+    if (!buckets || !chains) return SymbolLookup::Unknown;
+
+    uint32_t h = 0;
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p) {
+        h = (h << 4) + *p;
+        uint32_t g = h & 0xf0000000;
+        if (g) h ^= g >> 24;
+        h &= ~g;
+    }
+
+    uint32_t steps = 0;
+    for (uint32_t i = buckets[h % nbucket]; i != STN_UNDEF; i = chains[i]) {
+        if (i >= nchain || ++steps > nchain) return SymbolLookup::Unknown;
+        bool readable = true;
+        if (isDefinedSymbolNamed(image, dyn, i, name, readable)) {
+            return SymbolLookup::Found;
+        }
+        if (!readable) return SymbolLookup::Unknown;
+    }
+    
+    return SymbolLookup::Missing;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The x86 ISA levels (as in GNU_PROPERTY_X86_ISA_1_NEEDED) that this
+// CPU supports. Each level is tested by a few of its characteristic
+// features rather than exhaustively.
+static uint32_t supportedX86IsaLevels()
+{
+    __builtin_cpu_init();
+    uint32_t levels = 1; // baseline
+    if (__builtin_cpu_supports("popcnt") &&
+        __builtin_cpu_supports("ssse3") &&
+        __builtin_cpu_supports("sse4.2")) {
+        levels |= 2;
+        if (__builtin_cpu_supports("avx2") &&
+            __builtin_cpu_supports("bmi2") &&
+            __builtin_cpu_supports("fma")) {
+            levels |= 4;
+            if (__builtin_cpu_supports("avx512f") &&
+                __builtin_cpu_supports("avx512bw") &&
+                __builtin_cpu_supports("avx512cd") &&
+                __builtin_cpu_supports("avx512dq") &&
+                __builtin_cpu_supports("avx512vl")) {
+                levels |= 8;
+            }
+        }
+    }
+    return levels;
+}
+
+// Return the ISA levels required by the notes in the given note
+// segment, or 0 if none are given
+static uint32_t requiredX86IsaLevels(const ElfImage &image,
+                                     const ElfW(Phdr) &ph)
+{
+    const size_t align = (ph.p_align == 8 ? 8 : 4);
+    const size_t propertyAlign = sizeof(ElfW(Addr));
+    auto pad = [](size_t n, size_t a) { return (n + a - 1) & ~(a - 1); };
+    
+    size_t pos = ph.p_offset;
+    size_t end = ph.p_offset + ph.p_filesz;
+    if (end < pos) return 0;
+
+    while (pos + sizeof(ElfW(Nhdr)) <= end) {
+        const ElfW(Nhdr) *nh = image.at<ElfW(Nhdr)>(pos);
+        if (!nh) return 0;
+        // Offsets are aligned relative to the start of the note
+        size_t nameAt = pos + sizeof(ElfW(Nhdr));
+        size_t descAt = pos + pad(sizeof(ElfW(Nhdr)) + nh->n_namesz, align);
+        size_t next = descAt + pad(nh->n_descsz, align);
+        if (next > end || next <= pos) return 0;
+        const char *name = image.at<char>(nameAt, nh->n_namesz);
+        if (nh->n_type == NT_GNU_PROPERTY_TYPE_0 &&
+            nh->n_namesz == 4 && name && memcmp(name, "GNU", 4) == 0) {
+            size_t p = descAt;
+            size_t pend = descAt + nh->n_descsz;
+            while (p + 8 <= pend) {
+                const uint32_t *pr = image.at<uint32_t>(p, 2);
+                if (!pr) return 0;
+                size_t dataAt = p + 8;
+                if (pr[1] > pend - dataAt) return 0;
+                if (pr[0] == GNU_PROPERTY_X86_ISA_1_NEEDED && pr[1] == 4) {
+                    const uint32_t *levels = image.at<uint32_t>(dataAt);
+                    return levels ? *levels : 0;
+                }
+                p = dataAt + pad(pr[1], propertyAlign);
+            }
+        }
+        pos = next;
+    }
+    return 0;
+}
+
+#endif // x86
+
+static Result elfRejection(PluginCheckCode code, string soname, string why)
+{
+    return { code, soname + ": " + why };
+}
+
+// What we need to know about an ELF object's dynamic section
+struct ElfObject {
+    DynamicSymbols dyn;
+    vector<string> needed;
+    vector<string> rpath;
+    vector<string> runpath;
+};
+
+static vector<string> splitSearchPath(const char *s, string origin)
+{
+    vector<string> dirs;
+    string path(s);
+    string::size_type index = 0, newindex = 0;
+    while (index <= path.size()) {
+        newindex = path.find(':', index);
+        if (newindex == string::npos) newindex = path.size();
+        string dir = path.substr(index, newindex - index);
+        index = newindex + 1;
+        for (const char *token: { "$ORIGIN", "${ORIGIN}" }) {
+            string::size_type t;
+            while ((t = dir.find(token)) != string::npos) {
+                dir.replace(t, strlen(token), origin);
+            }
+        }
+        if (dir != "") dirs.push_back(dir);
+    }
+    return dirs;
+}
+
+// The directory that $ORIGIN stands for: that of the path the object
+// is opened by, with symlinks left unresolved, as the loader does it
+static string directoryOf(string path)
+{
+    string::size_type slash = path.rfind('/');
+    if (slash == string::npos) return ".";
+    if (slash == 0) return "/";
+    return path.substr(0, slash);
+}
+
+// Check the ELF header of an image, returning true if it is a shared
+// object for this architecture. If not, and rejection is non-null,
+// set it to the reason.
+static bool checkElfHeader(const ElfImage &image, string soname,
+                           Result *rejection)
+{
+    const ElfW(Ehdr) *eh = image.at<ElfW(Ehdr)>(0);
+    Result r { PluginCheckCode::SUCCESS, "" };
+
+    if (!eh) {
+        r = elfRejection(PluginCheckCode::FAIL_NOT_LOADABLE, soname,
+                         "file too short");
+    } else if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0) {
+        r = elfRejection(PluginCheckCode::FAIL_NOT_LOADABLE, soname,
+                         "invalid ELF header");
+    } else if (eh->e_ident[EI_CLASS] != NATIVE_ELF_CLASS) {
+        r = elfRejection(PluginCheckCode::FAIL_WRONG_ARCHITECTURE, soname,
+                         eh->e_ident[EI_CLASS] == ELFCLASS32 ?
+                         "wrong ELF class: ELFCLASS32" :
+                         "wrong ELF class: ELFCLASS64");
+    } else if (eh->e_ident[EI_DATA] != NATIVE_ELF_DATA) {
+        r = elfRejection(PluginCheckCode::FAIL_WRONG_ARCHITECTURE, soname,
+                         "ELF file data encoding not native");
+#ifdef NATIVE_ELF_MACHINE
+    } else if (eh->e_machine != NATIVE_ELF_MACHINE) {
+        r = elfRejection(PluginCheckCode::FAIL_WRONG_ARCHITECTURE, soname,
+                         "ELF file built for a different machine "
+                         "(e_machine " + to_string(eh->e_machine) + ")");
+#endif
+    } else if (eh->e_type != ET_DYN) {
+        r = elfRejection(PluginCheckCode::FAIL_NOT_LOADABLE, soname,
+                         "not a shared object");
+    }
+
+    if (rejection) *rejection = r;
+    return r.code == PluginCheckCode::SUCCESS;
+}
+
+// Read the program headers of an image whose ELF header has already
+// been checked. Returns false, with the reason in rejection, if the
+// notes show that it needs an ISA level this CPU lacks.
+static bool readElfObject(const ElfImage &image, string soname,
+                          ElfObject &obj, Result &rejection)
+{
+    const ElfW(Ehdr) *eh = image.at<ElfW(Ehdr)>(0);
+    const ElfW(Phdr) *ph = 0;
+    if (eh->e_phentsize == sizeof(ElfW(Phdr))) {
+        ph = image.at<ElfW(Phdr)>(eh->e_phoff, eh->e_phnum);
+    }
+
+    vector<size_t> needed;
+    size_t rpath = 0, runpath = 0;
+    bool haveRpath = false, haveRunpath = false;
+    
+    for (int i = 0; ph && i < eh->e_phnum; ++i) {
+
+#if defined(__x86_64__) || defined(__i386__)
+        if (ph[i].p_type == PT_NOTE) {
+            uint32_t required = requiredX86IsaLevels(image, ph[i]);
+            uint32_t unsupported = required & ~supportedX86IsaLevels();
+            if (unsupported) {
+                int level = 1;
+                while (unsupported >>= 1) ++level;
+                rejection = elfRejection
+                    (PluginCheckCode::FAIL_WRONG_ARCHITECTURE, soname,
+                     "requires x86-64-v" + to_string(level) +
+                     " instruction set, which this CPU does not support");
+                return false;
+            }
+        }
+#endif
+        
+        if (ph[i].p_type == PT_DYNAMIC) {
+            size_t count = ph[i].p_filesz / sizeof(ElfW(Dyn));
+            const ElfW(Dyn) *d = image.at<ElfW(Dyn)>(ph[i].p_offset, count);
+            for (size_t j = 0; d && j < count && d[j].d_tag != DT_NULL; ++j) {
+                switch (d[j].d_tag) {
+                case DT_SYMTAB:
+                    obj.dyn.symtab = image.offsetOf(d[j].d_un.d_ptr); break;
+                case DT_STRTAB:
+                    obj.dyn.strtab = image.offsetOf(d[j].d_un.d_ptr); break;
+                case DT_STRSZ:
+                    obj.dyn.strsz = d[j].d_un.d_val; break;
+                case DT_GNU_HASH:
+                    obj.dyn.gnuHash = image.offsetOf(d[j].d_un.d_ptr); break;
+                case DT_HASH:
+                    obj.dyn.sysvHash = image.offsetOf(d[j].d_un.d_ptr); break;
+                case DT_NEEDED:
+                    needed.push_back(d[j].d_un.d_val); break;
+                case DT_RPATH:
+                    rpath = d[j].d_un.d_val; haveRpath = true; break;
+                case DT_RUNPATH:
+                    runpath = d[j].d_un.d_val; haveRunpath = true; break;
+                }
+            }
+        }
+    }
+
+    // String table offsets can only be resolved once we know where
+    // the string table is
+    if (obj.dyn.strtab && obj.dyn.strsz) {
+        auto str = [&](size_t offset) -> const char * {
+            if (offset >= obj.dyn.strsz) return 0;
+            return image.string(obj.dyn.strtab + offset);
+        };
+        string origin = directoryOf(soname);
+        for (size_t n: needed) {
+            const char *s = str(n);
+            if (s) obj.needed.push_back(s);
+        }
+        if (haveRpath && str(rpath)) {
+            obj.rpath = splitSearchPath(str(rpath), origin);
+        }
+        if (haveRunpath && str(runpath)) {
+            obj.runpath = splitSearchPath(str(runpath), origin);
+        }
+    }
+
+    return true;
+}
+
+// Resolves the DT_NEEDED dependencies of libraries much as the
+// dynamic loader would, without loading anything, to find any that
+// are missing. Every lookup is remembered for the rest of the
+// session, as plugins mostly share the same handful of dependencies.
+// Where we can't be sure of the answer (no ld.so.cache we can read,
+// or search paths using $LIB or $PLATFORM) it gives up and leaves it
+// to dlopen() to find out.
+class DependencyResolver
+{
+public:
+    DependencyResolver() : m_usable(false) {
+        m_usable = readSystemSearchPath() && readLoaderCache();
+    }
+
+    // Add to missing the sonames of any dependencies of the given
+    // object, direct or indirect, that cannot be found. Returns false
+    // if that can't be determined.
+    bool findMissing(const ElfObject &obj, vector<string> &missing) {
+        if (!m_usable) return false;
+        set<string> visiting;
+        bool known = true;
+        collectMissing(obj, obj.rpath, visiting, missing, known);
+        return known;
+    }
+    
+private:
+    enum class Resolution { Found, Missing, Unknown };
+
+    struct Dependency {
+        bool compatible;
+        ElfObject obj;
+    };
+
+    struct Subtree {
+        vector<string> missing;
+        bool known;
+    };
+
+    bool m_usable;
+    vector<string> m_libraryPath;   // from LD_LIBRARY_PATH
+    vector<string> m_defaultDirs;   // the loader's built-in directories
+    multimap<string, string> m_loaderCache;
+    map<string, unique_ptr<Dependency>> m_dependencies;
+    map<string, pair<Resolution, string>> m_resolutions;
+    map<string, Subtree> m_subtrees;
+
+    bool readSystemSearchPath() {
+        // Ask the loader for its own default search path, as
+        // distributions differ. It lists LD_LIBRARY_PATH first, which
+        // we keep apart, as it is searched before DT_RUNPATH and the
+        // rest after it.
+#ifdef __GLIBC__
+        if (const char *env = getenv("LD_LIBRARY_PATH")) {
+            string path(env);
+            string::size_type index = 0, newindex = 0;
+            while (index <= path.size()) {
+                newindex = path.find_first_of(":;", index);
+                if (newindex == string::npos) newindex = path.size();
+                string dir = path.substr(index, newindex - index);
+                if (dir != "") m_libraryPath.push_back(dir);
+                index = newindex + 1;
+            }
+        }
+        vector<string> unmatched = m_libraryPath;
+        void *self = dlopen(0, RTLD_LAZY);
+        Dl_serinfo size;
+        if (!self || dlinfo(self, RTLD_DI_SERINFOSIZE, &size) != 0) {
+            return false;
+        }
+        vector<char> buffer(size.dls_size);
+        Dl_serinfo *info = (Dl_serinfo *)buffer.data();
+        if (dlinfo(self, RTLD_DI_SERINFOSIZE, info) != 0 ||
+            dlinfo(self, RTLD_DI_SERINFO, info) != 0) {
+            return false;
+        }
+        for (unsigned int i = 0; i < info->dls_cnt; ++i) {
+            string dir = info->dls_serpath[i].dls_name;
+            auto j = find(unmatched.begin(), unmatched.end(), dir);
+            if (j != unmatched.end()) {
+                unmatched.erase(j);
+            } else {
+                m_defaultDirs.push_back(dir);
+            }
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    bool readLoaderCache() {
+        // Read the glibc ld.so.cache, in either the new format or
+        // the old format with the new one appended
+        int fd = open("/etc/ld.so.cache", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            close(fd);
+            return false;
+        }
+        size_t size = size_t(st.st_size);
+        void *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return false;
+        
+        const char *data = (const char *)map;
+        const char newMagic[] = "glibc-ld.so.cache1.1";
+        const char oldMagic[] = "ld.so-1.7.0";
+        size_t start = 0;
+        
+        if (size > sizeof(oldMagic) + 4 &&
+            memcmp(data, oldMagic, sizeof(oldMagic) - 1) == 0) {
+            uint32_t nlibs;
+            memcpy(&nlibs, data + sizeof(oldMagic) - 1 + 1, 4);
+            start = (sizeof(oldMagic) - 1 + 1 + 4 + size_t(nlibs) * 12 + 7)
+                & ~size_t(7);
+        }
+
+        bool ok = false;
+        const size_t headerSize = 48, entrySize = 24;
+        if (start + headerSize <= size &&
+            memcmp(data + start, newMagic, sizeof(newMagic) - 1) == 0) {
+            uint32_t nlibs;
+            memcpy(&nlibs, data + start + 20, 4);
+            if (nlibs <= (size - start - headerSize) / entrySize) {
+                ok = true;
+                const char *base = data + start;
+                size_t limit = size - start;
+                for (uint32_t i = 0; i < nlibs; ++i) {
+                    uint32_t kv[2];
+                    memcpy(kv, base + headerSize + i * entrySize + 4, 8);
+                    if (kv[0] >= limit || kv[1] >= limit ||
+                        !memchr(base + kv[0], '\0', limit - kv[0]) ||
+                        !memchr(base + kv[1], '\0', limit - kv[1])) {
+                        ok = false;
+                        break;
+                    }
+                    m_loaderCache.insert({ base + kv[0], base + kv[1] });
+                }
+            }
+        }
+
+        munmap(map, size);
+        if (!ok) m_loaderCache.clear();
+        return ok;
+    }
+
+    const Dependency &dependency(string path) {
+        auto i = m_dependencies.find(path);
+        if (i != m_dependencies.end()) return *i->second;
+        
+        unique_ptr<Dependency> dep(new Dependency);
+        dep->compatible = false;
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            st.st_size > 0) {
+            size_t size = size_t(st.st_size);
+            void *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                ElfImage image((const unsigned char *)map, size);
+                Result rejection;
+                dep->compatible = checkElfHeader(image, path, 0) &&
+                    readElfObject(image, path, dep->obj, rejection);
+                munmap(map, size);
+            }
+        }
+        if (fd >= 0) close(fd);
+        
+        return *(m_dependencies[path] = move(dep));
+    }
+
+    Resolution resolve(string soname, const vector<string> &dirs,
+                       string &found) {
+        if (soname.find('/') != string::npos) {
+            found = soname;
+            return dependency(soname).compatible ?
+                Resolution::Found : Resolution::Missing;
+        }
+
+        string key = soname;
+        for (const auto &d: dirs) key += ":" + d;
+        auto memo = m_resolutions.find(key);
+        if (memo != m_resolutions.end()) {
+            found = memo->second.second;
+            return memo->second.first;
+        }
+
+        // The given directories are searched first, then the loader
+        // cache, then the default directories
+        Resolution result = Resolution::Missing;
+        bool uncertain = false;
+        auto search = [&](const vector<string> &dirs) {
+            for (const auto &d: dirs) {
+                if (d.find('$') != string::npos) {
+                    uncertain = true;
+                    continue;
+                }
+                string candidate = d + "/" + soname;
+                if (dependency(candidate).compatible) {
+                    found = candidate;
+                    result = Resolution::Found;
+                    return;
+                }
+            }
+        };
+        search(dirs);
+        if (result != Resolution::Found) {
+            auto range = m_loaderCache.equal_range(soname);
+            for (auto i = range.first; i != range.second; ++i) {
+                if (dependency(i->second).compatible) {
+                    found = i->second;
+                    result = Resolution::Found;
+                    break;
+                }
+            }
+        }
+        if (result != Resolution::Found) {
+            search(m_defaultDirs);
+        }
+        if (result == Resolution::Missing && uncertain) {
+            result = Resolution::Unknown;
+        }
+
+        m_resolutions[key] = { result, found };
+        return result;
+    }
+
+    void collectMissing(const ElfObject &obj,
+                        const vector<string> &rpathChain,
+                        set<string> &visiting,
+                        vector<string> &missing,
+                        bool &known) {
+        
+        // Searched in glibc's order: DT_RPATH, which applies to the
+        // object's dependencies and theirs in turn but is ignored
+        // altogether if it has a DT_RUNPATH, then LD_LIBRARY_PATH,
+        // then DT_RUNPATH, and then (in resolve) the loader cache
+        // and the default directories
+        vector<string> dirs;
+        if (obj.runpath.empty()) {
+            dirs = rpathChain;
+        }
+        dirs.insert(dirs.end(), m_libraryPath.begin(), m_libraryPath.end());
+        dirs.insert(dirs.end(), obj.runpath.begin(), obj.runpath.end());
+        
+        for (const auto &soname: obj.needed) {
+
+            // Already loaded into this process, so found by soname
+            void *loaded = dlopen(soname.c_str(), RTLD_LAZY | RTLD_NOLOAD);
+            if (loaded) {
+                dlclose(loaded);
+                continue;
+            }
+            
+            string found;
+            Resolution r = resolve(soname, dirs, found);
+            if (r == Resolution::Unknown) {
+                known = false;
+                continue;
+            }
+            if (r == Resolution::Missing) {
+                if (find(missing.begin(), missing.end(), soname) ==
+                    missing.end()) {
+                    missing.push_back(soname);
+                }
+                continue;
+            }
+            if (visiting.find(found) != visiting.end()) {
+                continue; // a dependency cycle
+            }
+
+            // A subtree depends on the DT_RPATH chain it inherits as
+            // well as on the dependency itself, so a dependency
+            // shared by libraries with different chains is resolved
+            // once for each
+            vector<string> chain = rpathChain;
+            const ElfObject &dep = dependency(found).obj;
+            chain.insert(chain.end(), dep.rpath.begin(), dep.rpath.end());
+            string memoKey = found;
+            for (const auto &d: chain) memoKey += ":" + d;
+            
+            auto memo = m_subtrees.find(memoKey);
+            if (memo == m_subtrees.end()) {
+                Subtree subtree { {}, true };
+                visiting.insert(found);
+                collectMissing(dep, chain, visiting,
+                               subtree.missing, subtree.known);
+                visiting.erase(found);
+                memo = m_subtrees.insert({ memoKey, subtree }).first;
+            }
+            
+            known = known && memo->second.known;
+            for (const auto &m: memo->second.missing) {
+                if (find(missing.begin(), missing.end(), m) ==
+                    missing.end()) {
+                    missing.push_back(m);
+                }
+            }
+        }
+    }
+};
+
+static DependencyResolver &dependencyResolver()
+{
+    static DependencyResolver resolver;
+    return resolver;
+}
+
+struct Inspection {
+    /// True if the library can be rejected outright
+    bool rejected;
+
+    /// Reason for rejection, if rejected
+    Result rejection;
+
+    /// For each descriptor, true if it is known to be absent
+    vector<bool> missing;
+};
+
+static Inspection inspectElf(string soname, const vector<string> &descriptors)
+{
+    Inspection inspection { false, {}, vector<bool>(descriptors.size(), false) };
+
+    int fd = open(soname.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return inspection; // let dlopen report on it
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return inspection;
+    }
+    
+    size_t size = size_t(st.st_size);
+    if (size < sizeof(ElfW(Ehdr))) {
+        close(fd);
+        inspection.rejected = true;
+        inspection.rejection = elfRejection
+            (PluginCheckCode::FAIL_NOT_LOADABLE, soname, "file too short");
+        return inspection;
+    }
+
+    void *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return inspection;
+    }
+
+    ElfImage image((const unsigned char *)map, size);
+    ElfObject obj;
+    
+    if (!checkElfHeader(image, soname, &inspection.rejection) ||
+        !readElfObject(image, soname, obj, inspection.rejection)) {
+        inspection.rejected = true;
+        munmap(map, size);
+        return inspection;
+    }
+
+    vector<string> missingDependencies;
+    if (dependencyResolver().findMissing(obj, missingDependencies) &&
+        !missingDependencies.empty()) {
+        string list;
+        for (const auto &m: missingDependencies) {
+            if (list != "") list += ", ";
+            list += m;
+        }
+        inspection.rejected = true;
+        inspection.rejection = elfRejection
+            (PluginCheckCode::FAIL_DEPENDENCY_MISSING, soname,
+             "cannot find required " +
+             string(missingDependencies.size() > 1 ?
+                    "libraries " : "library ") + list);
+        munmap(map, size);
+        return inspection;
+    }
+
+    const DynamicSymbols &dyn = obj.dyn;
+    if (dyn.symtab && dyn.strtab && dyn.strsz &&
+        (dyn.gnuHash || dyn.sysvHash)) {
+        for (size_t i = 0; i < descriptors.size(); ++i) {
+            const char *name = descriptors[i].c_str();
+            SymbolLookup found = dyn.gnuHash ?
+                lookupGnuHash(image, dyn, name) :
+                lookupSysvHash(image, dyn, name);
+            inspection.missing[i] = (found == SymbolLookup::Missing);
+        }
+    }
+
+    munmap(map, size);
+    return inspection;
+}
+
+#endif // __linux__
+
+// Descriptor that results are written to: the caller's choice, or
+// else a duplicate of the original standard output
+static int normalFd = -1;
+
+static void initFds(int resultFd)
+{
+    // Results go to normalFd and standard output is discarded, so
+    // that plugins can write what they like to it
+#ifdef _WIN32
+    (void)resultFd;
+    normalFd = _dup(1);
+    int nullFd = _open("NUL", _O_WRONLY);
+    if (normalFd >= 0 && nullFd >= 0) {
+        _dup2(nullFd, 1);
+        _close(nullFd);
+    }
+#else
+    normalFd = (resultFd >= 0 ? resultFd : dup(1));
+    int nullFd = open("/dev/null", O_WRONLY);
+    if (normalFd >= 0 && nullFd >= 0) {
+        dup2(nullFd, 1);
+        close(nullFd);
+    }
+#endif
+    
+    if (normalFd < 0 || nullFd < 0) {
+        throw std::runtime_error
+            ("Failed to initialise fds for result output");
+    }
+}
+
+// Write the whole of the given output to the result descriptor at
+// once, retrying only if it is interrupted or only partly written
+static void writeOutput(const string &output)
+{
+    const char *data = output.c_str();
+    size_t len = output.size();
+    while (len > 0) {
+#ifdef _WIN32
+        int n = _write(normalFd, data, unsigned(len));
+#else
+        ssize_t n = write(normalFd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+#endif
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static Result crashResult(int sig)
+{
+#ifdef _WIN32
+    const char *name = 0;
+#else
+    const char *name = strsignal(sig);
+#endif
+    return { PluginCheckCode::FAIL_CRASHED,
+             "Plugin crashed with signal " + to_string(sig) +
+             (name ? string(" (") + name + ")" : string()) };
+}
+
+// Write a report prepared in advance, from a signal handler or the
+// watchdog, where nothing that allocates or takes a lock is safe
+static void writePreparedReport(const string &report)
+{
+#ifdef _WIN32
+    _write(normalFd, report.c_str(), unsigned(report.size()));
+#else
+    ssize_t n = write(normalFd, report.c_str(), report.size());
+    (void)n;
+#endif
+}
+
+static const int caughtSignals[] = {
+    SIGINT, SIGTERM, SIGSEGV, SIGILL, SIGABRT, SIGFPE,
+#ifndef _WIN32
+    SIGHUP, SIGQUIT, SIGBUS,
+#endif
+};
+
+static const size_t caughtSignalCount =
+    sizeof(caughtSignals) / sizeof(caughtSignals[0]);
+
+// The report for each caught signal, should it arrive while a
+// library is being checked in-process. Like the timeout report,
+// these are prepared before the check starts, and crashReportsReady
+// is only set while they are complete.
+static string crashReports[caughtSignalCount];
+static volatile sig_atomic_t crashReportsReady = 0;
+
+static void prepareCrashReports(size_t resultCount)
+{
+    crashReportsReady = 0;
+    for (size_t i = 0; i < caughtSignalCount; ++i) {
+        Result result = crashResult(caughtSignals[i]);
+        crashReports[i] = "";
+        for (size_t j = 0; j < resultCount; ++j) {
+            crashReports[i] += formatResult(currentSoname, result);
+        }
+    }
+    crashReportsReady = 1;
+}
+
+static void
+signalHandler(int signal)
+{
+    // Reported on the result descriptor, as any other result is,
+    // just as the fork server reports a child that crashed
+    if (crashReportsReady) {
+        for (size_t i = 0; i < caughtSignalCount; ++i) {
+            if (caughtSignals[i] == signal) {
+                writePreparedReport(crashReports[i]);
+            }
+        }
+    }
+    _exit(1);
+}
+
+static void
+setSignalHandlers(void (*handler)(int))
+{
+    for (size_t i = 0; i < caughtSignalCount; ++i) {
+        signal(caughtSignals[i], handler);
+    }
+}
+
+// The watchdog used when checking in-process. If it fires, the check
+// is abandoned and we report the timeout straight to the real stdout
+// and exit. The report is prepared before arming the watchdog so that
+// firing it involves no allocation.
+
+static string timeoutReport;
+
+static Result timeoutResult()
+{
+    return { PluginCheckCode::FAIL_TIMED_OUT,
+             "Plugin check timed out after " + to_string(libraryTimeoutMs) +
+             " ms" };
+}
+
+static void prepareTimeoutReport(size_t resultCount)
+{
+    // One report for each result we were going to print
+    timeoutReport = "";
+    for (size_t i = 0; i < resultCount; ++i) {
+        timeoutReport += formatResult(currentSoname, timeoutResult());
+    }
+}
+
+static void reportTimeoutAndExit()
+{
+    writePreparedReport(timeoutReport);
+#ifdef _WIN32
+    TerminateProcess(GetCurrentProcess(), 1);
+#else
+    _exit(1);
+#endif
+}
+
+#ifdef _WIN32
+
+static HANDLE watchdogTimer = 0;
+
+static VOID CALLBACK watchdogCallback(PVOID, BOOLEAN)
+{
+    reportTimeoutAndExit();
+}
+
+static void armWatchdog(size_t resultCount)
+{
+    if (libraryTimeoutMs <= 0) return;
+    prepareTimeoutReport(resultCount);
+    CreateTimerQueueTimer(&watchdogTimer, NULL, watchdogCallback, NULL,
+                          libraryTimeoutMs, 0, WT_EXECUTEONLYONCE);
+}
+
+static void disarmWatchdog()
+{
+    if (watchdogTimer) {
+        DeleteTimerQueueTimer(NULL, watchdogTimer, INVALID_HANDLE_VALUE);
+        watchdogTimer = 0;
+    }
+}
+
+#else
+
+static void watchdogHandler(int)
+{
+    reportTimeoutAndExit();
+}
+
+static void armWatchdog(size_t resultCount)
+{
+    if (libraryTimeoutMs <= 0) return;
+    prepareTimeoutReport(resultCount);
+    signal(SIGALRM, watchdogHandler);
+    struct itimerval tv;
+    tv.it_interval.tv_sec = 0;
+    tv.it_interval.tv_usec = 0;
+    tv.it_value.tv_sec = libraryTimeoutMs / 1000;
+    tv.it_value.tv_usec = (libraryTimeoutMs % 1000) * 1000;
+    setitimer(ITIMER_REAL, &tv, 0);
+}
+
+static void disarmWatchdog()
+{
+    if (libraryTimeoutMs <= 0) return;
+    struct itimerval tv;
+    tv.it_interval.tv_sec = 0;
+    tv.it_interval.tv_usec = 0;
+    tv.it_value.tv_sec = 0;
+    tv.it_value.tv_usec = 0;
+    setitimer(ITIMER_REAL, &tv, 0);
+}
+
+#endif
+
+Results checkWithWatchdog(string soname, const vector<string> &descriptors)
+{
+    // A crash or timeout is reported for every result due for the
+    // library, not just those for the descriptors still to be
+    // checked here
+    prepareCrashReports(currentResultCount);
+    armWatchdog(currentResultCount);
+    Results results = check(soname, descriptors);
+    disarmWatchdog();
+    crashReportsReady = 0;
+    return results;
+}
+
+#ifndef _WIN32
+
+static long long monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// In fork-server mode, the libraries listed here are loaded once
+// into the parent process before any checks are done, so that each
+// forked child finds them already mapped and relocated instead of
+// loading them again. They are loaded RTLD_LOCAL so as not to change
+// how symbols in the plugins themselves are resolved, and it doesn't
+// matter if any of them are missing.
+
+static const char *const commonDependencies[] = {
+#ifdef __APPLE__
+    "libc++.1.dylib",
+    "libvamp-sdk.2.dylib",
+#else
+    "libstdc++.so.6",
+    "libgcc_s.so.1",
+    "libm.so.6",
+    "libvamp-sdk.so.2",
+#endif
+    0
+};
+
+static void preloadCommonDependencies()
+{
+    for (int i = 0; commonDependencies[i]; ++i) {
+        (void)dlopen(commonDependencies[i], RTLD_NOW | RTLD_LOCAL);
+    }
+}
+
+static bool writeAll(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+Results checkInChild(string soname, const vector<string> &descriptors)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        cerr << "Failed to create pipe (" << strerror(errno)
+             << "), checking in-process instead" << endl;
+        return checkWithWatchdog(soname, descriptors);
+    }
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        cerr << "Failed to fork (" << strerror(errno)
+             << "), checking in-process instead" << endl;
+        close(fds[0]);
+        close(fds[1]);
+        return checkWithWatchdog(soname, descriptors);
+    }
+
+    if (pid == 0) {
+        // Child: let any fatal signal take us down, so the parent
+        // sees it, and report each result as the code, message
+        // length and plugin count, followed by the timings, the
+        // memory use, the message and then the plugins. Use _exit so as not to flush
+        // any stdio buffers inherited from the parent.
+        close(fds[0]);
+        setSignalHandlers(SIG_DFL);
+#ifdef __linux__
+        // If the host kills our parent (e.g. to cancel a scan), don't
+        // leave a hung plugin behind
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() == 1) _exit(1);
+#endif
+        if (traceFd >= 0) {
+            traceName("thread_name", "child " + to_string(getpid()) +
+                      " for " + soname);
+        }
+        Results results = check(soname, descriptors);
+        for (size_t i = 0; i < results.size(); ++i) {
+            int header[3];
+            header[0] = int(results[i].code);
+            header[1] = int(results[i].message.size());
+            header[2] = int(results[i].plugins.size());
+            writeAll(fds[1], (const char *)header, sizeof(header));
+            writeAll(fds[1], (const char *)&results[i].timings,
+                     sizeof(Timings));
+            writeAll(fds[1], (const char *)&results[i].memory,
+                     sizeof(Memory));
+            writeAll(fds[1], results[i].message.c_str(), header[1]);
+            for (const auto &p: results[i].plugins) {
+                string fields = p.identifier + '\0' + p.name;
+                int pheader[2];
+                pheader[0] = p.number;
+                pheader[1] = int(fields.size());
+                writeAll(fds[1], (const char *)pheader, sizeof(pheader));
+                writeAll(fds[1], fields.c_str(), pheader[1]);
+            }
+        }
+        close(fds[1]);
+        _exit(0);
+    }
+
+    close(fds[1]);
+
+    // Read the child's report until it closes the pipe, killing it if
+    // it runs over the time budget
+    
+    string report;
+    char buf[1024];
+    bool timedOut = false;
+    long long start = monotonicMs();
+    
+    while (true) {
+        int wait = -1;
+        if (libraryTimeoutMs > 0) {
+            wait = int(start + libraryTimeoutMs - monotonicMs());
+            if (wait <= 0) {
+                timedOut = true;
+                break;
+            }
+        }
+        struct pollfd pfd;
+        pfd.fd = fds[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int rv = poll(&pfd, 1, wait);
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv < 0) break;
+        if (rv == 0) continue; // loop back to check the budget
+        ssize_t n = read(fds[0], buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        report.append(buf, n);
+    }
+    close(fds[0]);
+
+    if (timedOut) {
+        kill(pid, SIGKILL);
+    }
+    
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) ;
+
+    size_t n = descriptors.size();
+    
+    if (timedOut) {
+        return Results(n, timeoutResult());
+    }
+
+    if (WIFSIGNALED(status)) {
+        return Results(n, crashResult(WTERMSIG(status)));
+    }
+
+    Results results;
+    size_t pos = 0;
+    while (results.size() < n &&
+           pos + 3 * sizeof(int) + sizeof(Timings) + sizeof(Memory) <=
+           report.size()) {
+        int header[3];
+        memcpy(header, report.data() + pos, sizeof(header));
+        pos += sizeof(header);
+        Timings timings;
+        memcpy(&timings, report.data() + pos, sizeof(timings));
+        pos += sizeof(timings);
+        Memory memory;
+        memcpy(&memory, report.data() + pos, sizeof(memory));
+        pos += sizeof(memory);
+        if (header[1] < 0 || pos + header[1] > report.size()) break;
+        Result result(PluginCheckCode(header[0]),
+                      report.substr(pos, header[1]));
+        result.timings = timings;
+        result.memory = memory;
+        pos += header[1];
+        bool complete = true;
+        for (int i = 0; i < header[2]; ++i) {
+            int pheader[2];
+            if (pos + sizeof(pheader) > report.size()) {
+                complete = false;
+                break;
+            }
+            memcpy(pheader, report.data() + pos, sizeof(pheader));
+            pos += sizeof(pheader);
+            if (pheader[1] < 0 || pos + pheader[1] > report.size()) {
+                complete = false;
+                break;
+            }
+            string fields = report.substr(pos, pheader[1]);
+            pos += pheader[1];
+            string::size_type nul = fields.find('\0');
+            result.plugins.push_back({ pheader[0], fields.substr(0, nul),
+                                       nul == string::npos ? string() :
+                                       fields.substr(nul + 1) });
+        }
+        if (!complete) break;
+        results.push_back(result);
+    }
+
+    if (results.size() < n) {
+        int exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        return Results(n, { PluginCheckCode::FAIL_CRASHED,
+                            "Plugin caused checker to exit with code " +
+                            to_string(exitCode) });
+    }
+
+    return results;
+}
+
+#endif // !_WIN32
+
+static Results checkLibraryUntimed(string soname,
+                                   const vector<string> &descriptors,
+                                   bool forkServer, long long &inspectUs)
+{
+#ifdef _WIN32
+    (void)forkServer;
+    (void)inspectUs;
+    return checkWithWatchdog(soname, descriptors);
+#else
+    vector<string> toCheck = descriptors;
+    
+#ifdef __linux__
+    long long start = monotonicUs();
+    Inspection inspection = inspectElf(soname, descriptors);
+    inspectUs = monotonicUs() - start;
+    if (traceFd >= 0) {
+        traceSpan("inspect", start, start + inspectUs,
+                  traceArg("library", soname) + "," +
+                  traceArg("rejected", inspection.rejected ? "1" : "0"));
+    }
+    if (inspection.rejected) {
+        return Results(descriptors.size(), inspection.rejection);
+    }
+    toCheck.clear();
+    for (size_t i = 0; i < descriptors.size(); ++i) {
+        if (!inspection.missing[i]) {
+            toCheck.push_back(descriptors[i]);
+        }
+    }
+#endif
+
+    Results checked;
+    if (!toCheck.empty()) {
+        checked = forkServer ?
+            checkInChild(soname, toCheck) :
+            checkWithWatchdog(soname, toCheck);
+    }
+    
+    if (toCheck.size() == descriptors.size()) {
+        return checked;
+    }
+
+    // Merge in the descriptors we already know to be missing
+    Results results;
+    size_t j = 0;
+    for (size_t i = 0; i < descriptors.size(); ++i) {
+        if (j < toCheck.size() && toCheck[j] == descriptors[i]) {
+            results.push_back(checked[j++]);
+        } else {
+            results.push_back({ PluginCheckCode::FAIL_DESCRIPTOR_MISSING,
+                                soname + ": undefined symbol: " +
+                                descriptors[i] });
+        }
+    }
+    return results;
+#endif
+}
+
+Results checkLibrary(string soname, const vector<string> &descriptors,
+                     bool forkServer)
+{
+    long long start = monotonicUs();
+    long long inspectUs = 0;
+    Results results =
+        checkLibraryUntimed(soname, descriptors, forkServer, inspectUs);
+    long long total = monotonicUs() - start;
+    long long resident = 0;
+#ifdef __linux__
+    if (reportMemory) {
+        resident = residentBytes();
+    }
+#endif
+    for (auto &r: results) {
+        r.timings.inspect = inspectUs;
+        r.timings.total = total;
+        r.memory.helperResident = resident;
+    }
+    return results;
+}
+
+static vector<string> splitDescriptors(string list)
+{
+    vector<string> descriptors;
+    string::size_type index = 0, newindex = 0;
+    while ((newindex = list.find(',', index)) != string::npos) {
+        descriptors.push_back(list.substr(index, newindex - index));
+        index = newindex + 1;
+    }
+    descriptors.push_back(list.substr(index));
+    return descriptors;
+}
+
+// Return true if the given string is usable as a list of descriptor
+// names, i.e. if it can't be mistaken for the start of a path
+static bool isDescriptorList(string s)
+{
+    if (s == "") return false;
+    for (size_t i = 0; i < s.size(); ++i) {
+        char c = s[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+              (c >= '0' && c <= '9') || c == '_' || c == ',')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bool allGood = true;
+    string soname;
+
+    bool showUsage = false;
+    bool forkServer = false;
+    int resultFd = -1;
+    string traceFile;
+    string descriptor;
+    
+    // An option that takes a value must be followed by the value
+    // and then at least the descriptor list, hence i + 2 < argc
+    for (int i = 1; i < argc; ++i) {
+        string opt = argv[i];
+        if (opt == "-?" || opt == "-h" || opt == "--help") {
+            showUsage = true;
+        } else if (opt == "-v" || opt == "--version") {
+            cout << CHECKER_COMPATIBILITY_VERSION << endl;
+            return 0;
+        } else if (opt == "--fork") {
+            forkServer = true;
+        } else if (opt == "--timeout" && i + 2 < argc) {
+            libraryTimeoutMs = atoi(argv[++i]);
+        } else if (opt == "--binary") {
+            binaryOutput = true;
+        } else if (opt == "--plugin-info") {
+            reportPluginInfo = true;
+        } else if (opt == "--timings") {
+            reportTimings = true;
+        } else if (opt == "--memory") {
+            reportMemory = true;
+        } else if (opt == "--result-fd" && i + 2 < argc) {
+            resultFd = atoi(argv[++i]);
+        } else if (opt == "--trace" && i + 2 < argc) {
+            traceFile = argv[++i];
+        } else if (i + 1 == argc && opt.size() > 0 && opt[0] != '-') {
+            descriptor = opt;
+        } else {
+            showUsage = true;
+        }
+    } 
+    
+    if (descriptor == "" || showUsage) {
+        cerr << endl;
+        cerr << programName << ": Test shared library objects for plugins to be" << endl;
+        cerr << "loaded via descriptor functions." << endl;
+        cerr << "\n    Usage: " << programName << " [--fork] [--timeout <ms>] [--binary]\n"
+            "        [--plugin-info] [--timings] [--memory] [--result-fd <fd>]\n"
+            "        [--trace <file>] <descriptorname>[,...]\n"
+            "\nwhere descriptorname is the name of a plugin descriptor symbol to be sought\n"
+            "in each library (e.g. vampGetPluginDescriptor for Vamp plugins). The list of\n"
+            "candidate plugin library filenames is read from stdin. If more than one\n"
+            "descriptor name is given, a result is printed for each in turn. An input\n"
+            "line of |quit ends the list.\n"
+            "\nWith --fork, each library is checked in a separate child process, so that\n"
+            "a crashing library is reported and checking continues with the next one.\n"
+            "\nWith --timeout, a library that takes longer than the given number of\n"
+            "milliseconds to check is reported as having timed out.\n"
+            "\nWith --binary, results are written as length-prefixed binary records\n"
+            "rather than as lines of text.\n"
+            "\nWith --plugin-info, the identifier, name and version or unique ID of each\n"
+            "plugin found are also reported, before the result for the library.\n"
+            "\nWith --timings, the time in microseconds taken by each phase of checking\n"
+            "is also reported, before each result.\n"
+            "\nWith --memory, the resident set size and number of mapped regions before\n"
+            "and after checking each library, whether the library remained mapped, and\n"
+            "the resident set size of this program are also reported, before each\n"
+            "result (Linux only).\n"
+            "\nWith --result-fd, results are written to the given file descriptor, which\n"
+            "must already be open, rather than to stdout. Either way, stdout itself is\n"
+            "discarded so that plugins cannot interfere with the results.\n"
+            "\nWith --trace, events showing the time taken by each library and each\n"
+            "phase of checking it are appended to the given file, in the JSON trace\n"
+            "event format read by chrome://tracing and Perfetto.\n" << endl;
+        return 2;
+    }
+
+    setSignalHandlers(signalHandler);
+
+    if (traceFile != "" && !openTrace(traceFile)) {
+        cerr << "Note: unable to open trace file \"" << traceFile
+             << "\"; not tracing" << endl;
+    }
+
+#ifdef _WIN32
+    if (forkServer) {
+        cerr << "Note: fork-server mode is not available on this platform; ignoring --fork" << endl;
+        forkServer = false;
+    }
+    if (resultFd >= 0) {
+        cerr << "Note: --result-fd is not available on this platform; writing results to stdout" << endl;
+        resultFd = -1;
+    }
+#else
+    if (resultFd >= 0 && fcntl(resultFd, F_GETFD) == -1) {
+        cerr << programName << ": result descriptor " << resultFd
+             << " is not open" << endl;
+        return 2;
+    }
+    if (forkServer) {
+        long long start = monotonicUs();
+        preloadCommonDependencies();
+        traceSpan("preload dependencies", start, monotonicUs());
+    }
+#endif
+
+#ifdef _WIN32
+    // Avoid showing the error-handler dialog for missing DLLs,
+    // failing quietly instead. It's permissible for this program
+    // to simply fail when a DLL can't be loaded -- showing the
+    // error dialog wouldn't change this anyway, it would just
+    // block the program until the user clicked it away and then
+    // fail anyway.
+    SetErrorMode(SEM_FAILCRITICALERRORS);
+#endif
+
+    initFds(resultFd);
+
+#ifdef _WIN32
+    if (binaryOutput) {
+        // Don't let the C runtime translate line endings in our frames
+        _setmode(1, _O_BINARY);
+        _setmode(normalFd, _O_BINARY);
+    }
+#endif
+    
+    vector<string> defaultDescriptors = splitDescriptors(descriptor);
+    string line;
+    
+    while (getline(cin, line)) {
+
+        if (line == "|quit") {
+            break;
+        }
+        
+        vector<string> descriptors = defaultDescriptors;
+        soname = line;
+
+        string::size_type bar = line.find('|');
+        if (bar != string::npos && isDescriptorList(line.substr(0, bar))) {
+            descriptors = splitDescriptors(line.substr(0, bar));
+            soname = line.substr(bar + 1);
+        }
+        
+        currentSoname = soname;
+        currentResultCount = descriptors.size();
+
+        long long start = (traceFd >= 0 ? monotonicUs() : 0);
+
+        Results results = checkLibrary(soname, descriptors, forkServer);
+        string output;
+        for (size_t i = 0; i < results.size(); ++i) {
+            output += formatResult(soname, results[i]);
+            if (results[i].code != PluginCheckCode::SUCCESS) {
+                allGood = false;
+            }
+        }
+
+        // Traced before the results are written, so that the event
+        // is in the file by the time the caller has them
+        if (traceFd >= 0) {
+            string names, codes;
+            for (size_t i = 0; i < results.size(); ++i) {
+                if (i > 0) {
+                    names += ",";
+                    codes += ",";
                 }
-                cout << "FAILURE|" << soname
-                     << "|" << result.message << " ["
-                     << int(result.code) << "]" << endl;
+                names += descriptors[i];
+                codes += to_string(int(results[i].code));
             }
-            allGood = false;
+            traceSpan("check library", start, monotonicUs(),
+                      traceArg("library", soname) + "," +
+                      traceArg("descriptors", names) + "," +
+                      traceArg("codes", codes));
         }
-        suspendOutput();
+
+        writeOutput(output);
     }
     
     return allGood ? 0 : 1;
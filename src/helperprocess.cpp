@@ -0,0 +1,473 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#include "helperprocess.h"
+
+#ifdef _WIN32
+#include <QProcess>
+#include <QElapsedTimer>
+#else
+#include <spawn.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <cerrno>
+#include <cstring>
+extern char **environ;
+#endif
+
+using namespace std;
+
+#ifdef _WIN32
+
+HelperProcess::HelperProcess() :
+    m_captureErrors(false)
+{
+}
+
+void
+HelperProcess::setOutputFd(int)
+{
+}
+
+HelperProcess::~HelperProcess()
+{
+    kill();
+}
+
+bool
+HelperProcess::start(string program,
+                     vector<string> args,
+                     bool captureErrors,
+                     string &error)
+{
+    m_captureErrors = captureErrors;
+    m_process.reset(new QProcess);
+    m_process->setProcessChannelMode(captureErrors ?
+                                     QProcess::SeparateChannels :
+                                     QProcess::ForwardedErrorChannel);
+    QStringList qargs;
+    for (const auto &a: args) {
+        qargs << QString::fromUtf8(a.c_str());
+    }
+    m_process->start(QString::fromUtf8(program.c_str()), qargs);
+    if (!m_process->waitForStarted()) {
+        error = m_process->errorString().toStdString();
+        m_process.reset();
+        return false;
+    }
+    return true;
+}
+
+size_t
+HelperProcess::write(const char *data, size_t length)
+{
+    // QProcess would buffer any amount: only hand it more once it
+    // has passed on most of what it already has
+    const qint64 limit = 65536;
+    if (!m_process || m_process->bytesToWrite() > limit / 2) {
+        return 0;
+    }
+    if (length > size_t(limit)) {
+        length = size_t(limit);
+    }
+    qint64 written = m_process->write(data, qint64(length));
+    return written > 0 ? size_t(written) : 0;
+}
+
+void
+HelperProcess::closeInput()
+{
+    if (m_process) {
+        m_process->closeWriteChannel();
+    }
+}
+
+size_t
+HelperProcess::read(char *buffer, size_t length)
+{
+    if (!m_process) {
+        return 0;
+    }
+    m_process->setReadChannel(QProcess::StandardOutput);
+    qint64 n = m_process->read(buffer, qint64(length));
+    return n > 0 ? size_t(n) : 0;
+}
+
+string
+HelperProcess::readErrors()
+{
+    if (!m_process || !m_captureErrors) {
+        return {};
+    }
+    QByteArray errors = m_process->readAllStandardError();
+    return string(errors.constData(), errors.size());
+}
+
+bool
+HelperProcess::isFinished() const
+{
+    if (!m_process) {
+        return true;
+    }
+    return m_process->state() == QProcess::NotRunning &&
+        m_process->bytesAvailable() == 0;
+}
+
+long long
+HelperProcess::processId() const
+{
+    return m_process ? m_process->processId() : 0;
+}
+
+void
+HelperProcess::kill()
+{
+    if (m_process && m_process->state() != QProcess::NotRunning) {
+        m_process->kill();
+        m_process->waitForFinished();
+    }
+    m_process.reset();
+}
+
+void
+HelperProcess::waitForAny(const vector<HelperProcess *> &processes,
+                          const vector<bool> &wantInput,
+                          int timeout)
+{
+    // QProcess offers no way to wait for several processes at once,
+    // so give each a short turn until one of them has something
+    QElapsedTimer timer;
+    timer.start();
+    while (true) {
+        for (size_t i = 0; i < processes.size(); ++i) {
+            QProcess *p = processes[i]->m_process.get();
+            if (!p || p->state() == QProcess::NotRunning ||
+                p->bytesAvailable() > 0 ||
+                (wantInput[i] && p->bytesToWrite() == 0)) {
+                return;
+            }
+            p->waitForBytesWritten(0);
+            if (p->waitForReadyRead(10)) {
+                return;
+            }
+        }
+        if (timeout >= 0 && timer.elapsed() >= timeout) {
+            return;
+        }
+    }
+}
+
+#else // !_WIN32
+
+static bool
+makePipe(int fds[2])
+{
+    // Close-on-exec, so that helpers started concurrently from other
+    // threads don't inherit the ends of each other's pipes and keep
+    // them open
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC) == 0;
+#else
+    if (pipe(fds) != 0) {
+        return false;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+#endif
+}
+
+static void
+closeFd(int &fd)
+{
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+static void
+setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void
+ignoreSigPipe()
+{
+    // As QProcess does: writing to a helper that has exited must not
+    // kill the host, but a handler the host has installed is left
+    // alone
+    struct sigaction action;
+    if (sigaction(SIGPIPE, nullptr, &action) == 0 &&
+        action.sa_handler == SIG_DFL) {
+        action.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &action, nullptr);
+    }
+}
+
+HelperProcess::HelperProcess() :
+    m_pid(-1),
+    m_in(-1),
+    m_out(-1),
+    m_err(-1),
+    m_outputFd(1),
+    m_exited(true)
+{
+}
+
+void
+HelperProcess::setOutputFd(int fd)
+{
+    m_outputFd = fd;
+}
+
+HelperProcess::~HelperProcess()
+{
+    kill();
+}
+
+bool
+HelperProcess::start(string program,
+                     vector<string> args,
+                     bool captureErrors,
+                     string &error)
+{
+    ignoreSigPipe();
+    
+    int in[2] = { -1, -1 }, out[2] = { -1, -1 }, err[2] = { -1, -1 };
+    if (!makePipe(in) || !makePipe(out) ||
+        (captureErrors && !makePipe(err))) {
+        error = strerror(errno);
+        closeFd(in[0]); closeFd(in[1]);
+        closeFd(out[0]); closeFd(out[1]);
+        closeFd(err[0]); closeFd(err[1]);
+        return false;
+    }
+
+    if (out[1] == m_outputFd) {
+        // dup2() onto itself would leave it close-on-exec
+        int fd = fcntl(out[1], F_DUPFD_CLOEXEC, m_outputFd + 1);
+        closeFd(out[1]);
+        out[1] = fd;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], 0);
+    if (captureErrors) {
+        posix_spawn_file_actions_adddup2(&actions, err[1], 2);
+    }
+    if (m_outputFd != 1) {
+        posix_spawn_file_actions_addopen(&actions, 1, "/dev/null",
+                                         O_WRONLY, 0);
+    }
+    posix_spawn_file_actions_adddup2(&actions, out[1], m_outputFd);
+
+    vector<char *> argv;
+    argv.push_back(const_cast<char *>(program.c_str()));
+    for (auto &a: args) {
+        argv.push_back(const_cast<char *>(a.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = -1;
+    int rc = posix_spawnp(&pid, program.c_str(), &actions, nullptr,
+                          argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    closeFd(in[0]);
+    closeFd(out[1]);
+    closeFd(err[1]);
+
+    if (rc != 0) {
+        error = strerror(rc);
+        closeFd(in[1]);
+        closeFd(out[0]);
+        closeFd(err[0]);
+        return false;
+    }
+
+    m_pid = pid;
+    m_in = in[1];
+    m_out = out[0];
+    m_err = err[0];
+    m_exited = false;
+
+    setNonBlocking(m_in);
+    setNonBlocking(m_out);
+    if (m_err >= 0) {
+        setNonBlocking(m_err);
+    }
+    
+    return true;
+}
+
+size_t
+HelperProcess::write(const char *data, size_t length)
+{
+    if (m_in < 0) {
+        return 0;
+    }
+    ssize_t n = ::write(m_in, data, length);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            // The helper has gone away: it will be noticed on the
+            // output side
+            closeFd(m_in);
+        }
+        return 0;
+    }
+    return size_t(n);
+}
+
+void
+HelperProcess::closeInput()
+{
+    closeFd(m_in);
+}
+
+size_t
+HelperProcess::read(char *buffer, size_t length)
+{
+    if (m_out < 0) {
+        return 0;
+    }
+    ssize_t n = ::read(m_out, buffer, length);
+    if (n > 0) {
+        return size_t(n);
+    }
+    if (n == 0 ||
+        (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        // End of output, which usually comes with the end of the
+        // process. Don't wait for it though: a helper that closes
+        // its output and then takes a while to exit would hold up
+        // all the others. If it hasn't gone yet it will be reaped
+        // when killed.
+        closeFd(m_out);
+        closeFd(m_in);
+        reap(false);
+    }
+    return 0;
+}
+
+string
+HelperProcess::readErrors()
+{
+    string errors;
+    char buffer[1024];
+    while (m_err >= 0) {
+        ssize_t n = ::read(m_err, buffer, sizeof(buffer));
+        if (n > 0) {
+            errors.append(buffer, n);
+        } else {
+            if (n == 0 ||
+                (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                closeFd(m_err);
+            }
+            break;
+        }
+    }
+    return errors;
+}
+
+bool
+HelperProcess::isFinished() const
+{
+    return m_out < 0;
+}
+
+long long
+HelperProcess::processId() const
+{
+    return m_pid > 0 ? m_pid : 0;
+}
+
+void
+HelperProcess::kill()
+{
+    if (!m_exited) {
+        ::kill(m_pid, SIGKILL);
+    }
+    closeFd(m_in);
+    closeFd(m_out);
+    closeFd(m_err);
+    reap(true);
+}
+
+void
+HelperProcess::reap(bool wait)
+{
+    if (m_exited) {
+        return;
+    }
+    int status = 0;
+    pid_t rv;
+    do {
+        rv = waitpid(m_pid, &status, wait ? 0 : WNOHANG);
+    } while (rv < 0 && errno == EINTR);
+    if (rv == m_pid || rv < 0) {
+        // rv < 0 if the host has arranged for children to be reaped
+        // automatically
+        m_exited = true;
+    }
+}
+
+void
+HelperProcess::waitForAny(const vector<HelperProcess *> &processes,
+                          const vector<bool> &wantInput,
+                          int timeout)
+{
+    vector<struct pollfd> fds;
+    for (size_t i = 0; i < processes.size(); ++i) {
+        const HelperProcess *p = processes[i];
+        if (p->isFinished()) {
+            return;
+        }
+        if (p->m_out >= 0) {
+            fds.push_back({ p->m_out, POLLIN, 0 });
+        }
+        if (p->m_err >= 0) {
+            fds.push_back({ p->m_err, POLLIN, 0 });
+        }
+        if (p->m_in >= 0 && wantInput[i]) {
+            fds.push_back({ p->m_in, POLLOUT, 0 });
+        }
+    }
+    if (fds.empty()) {
+        return;
+    }
+    poll(fds.data(), nfds_t(fds.size()), timeout);
+}
+
+#endif
@@ -0,0 +1,144 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#ifndef HELPER_PROCESS_H
+#define HELPER_PROCESS_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#ifdef _WIN32
+class QProcess;
+#endif
+
+/**
+ * A helper process with pipes to its standard input, output and
+ * (optionally) error, all used without blocking, so that any number
+ * of helpers can be driven from a single thread. waitForAny() blocks
+ * until at least one of a set of processes has something to report:
+ * output to read, room in its input pipe, or the end of its output.
+ *
+ * On POSIX platforms the process is started with posix_spawnp() and
+ * waited for with poll(). On Windows it is a QProcess, and
+ * waitForAny() has to poll each process in turn.
+ *
+ * Not thread-safe: each object is used by one thread at a time.
+ */
+class HelperProcess
+{
+public:
+    HelperProcess();
+
+    /** Kill the process if it is still running, and reap it.
+     */
+    ~HelperProcess();
+
+    /** Connect the output pipe to the given file descriptor in the
+     *  process, instead of to its standard output, which is then
+     *  sent to the null device. Must be called before start().
+     *  Ignored on Windows.
+     */
+    void setOutputFd(int fd);
+
+    /** Start the program with the given arguments. If captureErrors
+     *  is false, its standard error is that of the calling process.
+     *  Returns false and sets error if the program could not be
+     *  started.
+     */
+    bool start(std::string program,
+               std::vector<std::string> args,
+               bool captureErrors,
+               std::string &error);
+
+    /** Write as much of the given data as the input pipe will take
+     *  without blocking. Returns the number of bytes written, which
+     *  may be zero.
+     */
+    size_t write(const char *data, size_t length);
+
+    /** Close the input pipe, so that the process sees end of file.
+     */
+    void closeInput();
+
+    /** Read whatever output is available without blocking, up to
+     *  the given length. Returns the number of bytes read, which may
+     *  be zero.
+     */
+    size_t read(char *buffer, size_t length);
+
+    /** Read and return whatever error output is available, if
+     *  errors are being captured.
+     */
+    std::string readErrors();
+
+    /** Return true once the process's output has ended, or it has
+     *  been killed. On POSIX platforms the process may not yet have
+     *  exited: it is reaped (killing it first if need be) by kill()
+     *  or the destructor.
+     */
+    bool isFinished() const;
+
+    /** Return the operating system's ID for the process, or 0 if
+     *  it was never started.
+     */
+    long long processId() const;
+
+    /** Kill the process. It is finished once this returns.
+     */
+    void kill();
+
+    /** Wait for at most timeout ms (or indefinitely, if negative)
+     *  until at least one of the given processes can be read from,
+     *  written to (if wantInput is set for it) or has finished.
+     */
+    static void waitForAny(const std::vector<HelperProcess *> &processes,
+                           const std::vector<bool> &wantInput,
+                           int timeout);
+
+private:
+    HelperProcess(const HelperProcess &) = delete;
+    HelperProcess &operator=(const HelperProcess &) = delete;
+
+#ifdef _WIN32
+    std::unique_ptr<QProcess> m_process;
+    bool m_captureErrors;
+#else
+    void reap(bool wait);
+    
+    int m_pid;
+    int m_in;
+    int m_out;
+    int m_err;
+    int m_outputFd;
+    bool m_exited;
+#endif
+};
+
+#endif
@@ -0,0 +1,124 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#ifndef HELPER_PROTOCOL_H
+#define HELPER_PROTOCOL_H
+
+#include <cstdint>
+
+/**
+ * Framing for the binary output format that the helper writes when
+ * given the --binary option (since v8), shared between the helper
+ * and PluginCandidates.
+ *
+ * Each record is a HelperRecordHeader followed immediately by the
+ * library path and then the message, both as UTF-8 with no
+ * terminator. Header fields are in the native byte order of the
+ * machine, which the helper and host necessarily share. Unlike the
+ * text format, paths and messages may contain any characters at all.
+ */
+
+enum class HelperRecordKind : uint32_t {
+
+    /** The verdict on one descriptor in one library. The code is a
+     *  PluginCheckCode
+     */
+    Result = 1,
+
+    /** One plugin found by a descriptor function, with --plugin-info
+     *  (since v11). The code is the Vamp plugin version or the LADSPA
+     *  or DSSI UniqueID, and the message is the plugin identifier or
+     *  label and the plugin name, separated by a nul byte. The
+     *  Plugin records for a descriptor precede its Result record.
+     */
+    Plugin = 2,
+
+    /** The time taken by each phase of checking one descriptor in
+     *  one library, with --timings (since v12). The code is zero and
+     *  the message is a HelperTimings. The Timings record for a
+     *  descriptor immediately precedes its Result record.
+     */
+    Timings = 3,
+
+    /** Memory use around the check of one library, with --memory
+     *  (since v14, Linux only). The code is zero and the message is
+     *  a HelperMemory. The Memory record for a descriptor precedes
+     *  its Result record, following any Timings record.
+     */
+    Memory = 4
+};
+
+struct HelperRecordHeader {
+    uint32_t kind;
+    int32_t code;
+    uint32_t pathLength;
+    uint32_t messageLength;
+};
+
+static_assert(sizeof(HelperRecordHeader) == 16,
+              "helper record header must have no padding");
+
+/// Times in microseconds, as reported in a Timings record. The
+/// inspect, open, close and total times are for the whole library,
+/// and so are the same for each descriptor in it, except that the
+/// open and close times are zero for a descriptor that the pre-flight
+/// inspection found to be missing.
+struct HelperTimings {
+    int64_t inspect;    ///< ELF pre-flight inspection
+    int64_t open;       ///< dlopen
+    int64_t lookup;     ///< dlsym of the descriptor function
+    int64_t walk;       ///< walk through the descriptor's plugins
+    int64_t close;      ///< dlclose
+    int64_t total;      ///< whole check of the library, including fork
+};
+
+static_assert(sizeof(HelperTimings) == 48,
+              "helper timings must have no padding");
+
+/// Memory use as reported in a Memory record. All but the last are
+/// for the process that checked the library, which in fork-server
+/// mode is a child of the helper. The same values are reported for
+/// each descriptor in the library.
+struct HelperMemory {
+    int64_t residentBefore;   ///< resident set size in bytes, before dlopen
+    int64_t residentAfter;    ///< and after dlclose
+    int64_t mappingsBefore;   ///< number of mapped regions, before dlopen
+    int64_t mappingsAfter;    ///< and after dlclose
+    int64_t stillMapped;      ///< 1 if the library was mapped after dlclose
+    int64_t helperResident;   ///< resident set size of the helper itself
+};
+
+static_assert(sizeof(HelperMemory) == 48,
+              "helper memory must have no padding");
+
+/// Longest path or message a reader need accept. Anything longer
+/// means the stream is corrupt.
+static const uint32_t helperRecordMaxLength = 1 << 20;
+
+#endif
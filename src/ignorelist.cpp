@@ -0,0 +1,319 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#include "ignorelist.h"
+
+#include <unordered_map>
+
+using namespace std;
+
+struct IgnoreList::Node
+{
+    Node() : terminal(false), directory(false) { }
+
+    // Children for literal components, looked up by hash, and for
+    // glob components, tried in turn
+    unordered_map<string, unique_ptr<Node>> literals;
+    vector<pair<string, unique_ptr<Node>>> globs;
+
+    // Child for a ** component
+    unique_ptr<Node> anyDepth;
+
+    // Whether a pattern for a file, or for a directory and
+    // everything below it, ends here
+    bool terminal;
+    bool directory;
+};
+
+static bool
+isSeparator(char c)
+{
+#ifdef _WIN32
+    return c == '/' || c == '\\';
+#else
+    return c == '/';
+#endif
+}
+
+// Split a path into its components, ignoring empty ones, with an
+// initial "/" component if the path is absolute
+static vector<string>
+splitPath(const string &path)
+{
+    vector<string> components;
+    if (!path.empty() && isSeparator(path[0])) {
+        components.push_back("/");
+    }
+    size_t start = 0;
+    for (size_t i = 0; i <= path.size(); ++i) {
+        if (i == path.size() || isSeparator(path[i])) {
+            if (i > start) {
+                components.push_back(path.substr(start, i - start));
+            }
+            start = i + 1;
+        }
+    }
+    return components;
+}
+
+static bool
+isGlob(const string &component)
+{
+    return component.find_first_of("*?[") != string::npos;
+}
+
+// Match one character against the pattern element starting at pos,
+// which is not a *, and set next to the position following that
+// element. A [ with no closing ] is taken literally.
+static bool
+matchOne(const string &pattern, size_t pos, char c, size_t &next)
+{
+    char pc = pattern[pos];
+    
+    if (pc == '?') {
+        next = pos + 1;
+        return true;
+    }
+
+    if (pc == '[') {
+        size_t i = pos + 1;
+        bool negate = false;
+        if (i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^')) {
+            negate = true;
+            ++i;
+        }
+        bool matched = false;
+        bool first = true; // a ] straight after the [ is part of the set
+        while (i < pattern.size() && (first || pattern[i] != ']')) {
+            first = false;
+            unsigned char lo = pattern[i], hi = lo;
+            if (i + 2 < pattern.size() &&
+                pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+                hi = pattern[i + 2];
+                i += 3;
+            } else {
+                ++i;
+            }
+            if (lo <= (unsigned char)c && (unsigned char)c <= hi) {
+                matched = true;
+            }
+        }
+        if (i < pattern.size()) {
+            next = i + 1;
+            return matched != negate;
+        }
+    }
+
+    next = pos + 1;
+    return pc == c;
+}
+
+// Match a path component against a glob component, backtracking to
+// the most recent * on a mismatch
+static bool
+globMatch(const string &pattern, const string &text)
+{
+    size_t p = 0, t = 0;
+    size_t starP = string::npos, starT = 0;
+
+    while (t < text.size()) {
+        if (p < pattern.size()) {
+            if (pattern[p] == '*') {
+                starP = p++;
+                starT = t;
+                continue;
+            }
+            size_t next = 0;
+            if (matchOne(pattern, p, text[t], next)) {
+                p = next;
+                ++t;
+                continue;
+            }
+        }
+        if (starP == string::npos) {
+            return false;
+        }
+        p = starP + 1;
+        t = ++starT;
+    }
+
+    while (p < pattern.size() && pattern[p] == '*') {
+        ++p;
+    }
+    return p == pattern.size();
+}
+
+IgnoreList::IgnoreList(vector<string> patterns) :
+    m_root(new Node),
+    m_empty(true)
+{
+    for (const auto &pattern: patterns) {
+        add(pattern, false);
+        // Exact paths were all that could be given before globs
+        // were supported, and some of them may contain glob
+        // characters, so every pattern also matches itself
+        if (pattern.find_first_of("*?[") != string::npos) {
+            add(pattern, true);
+        }
+    }
+}
+
+IgnoreList::~IgnoreList()
+{
+}
+
+void
+IgnoreList::add(string pattern, bool literal)
+{
+    if (pattern.empty()) {
+        return;
+    }
+
+    bool directory = isSeparator(pattern[pattern.size() - 1]);
+    bool anchored = false;
+    for (char c: pattern) {
+        if (isSeparator(c)) {
+            anchored = true;
+            break;
+        }
+    }
+
+    vector<string> components = splitPath(pattern);
+    if (!anchored) {
+        // A bare name, which may be in any directory
+        components.insert(components.begin(), "**");
+    }
+
+    Node *node = m_root.get();
+    bool afterAnyDepth = false;
+    
+    for (size_t i = 0; i < components.size(); ++i) {
+        const string &c = components[i];
+        bool wild = !literal || (i == 0 && !anchored);
+        if (c == "**" && wild) {
+            // Consecutive ** components mean no more than one does
+            if (!afterAnyDepth) {
+                if (!node->anyDepth) {
+                    node->anyDepth.reset(new Node);
+                }
+                node = node->anyDepth.get();
+            }
+            afterAnyDepth = true;
+            continue;
+        }
+        afterAnyDepth = false;
+        if (!literal && isGlob(c)) {
+            Node *child = nullptr;
+            for (auto &g: node->globs) {
+                if (g.first == c) {
+                    child = g.second.get();
+                    break;
+                }
+            }
+            if (!child) {
+                child = new Node;
+                node->globs.push_back({ c, unique_ptr<Node>(child) });
+            }
+            node = child;
+        } else {
+            unique_ptr<Node> &child = node->literals[c];
+            if (!child) {
+                child.reset(new Node);
+            }
+            node = child.get();
+        }
+    }
+
+    if (directory) {
+        node->directory = true;
+    } else {
+        node->terminal = true;
+    }
+    m_empty = false;
+}
+
+bool
+IgnoreList::empty() const
+{
+    return m_empty;
+}
+
+bool
+IgnoreList::matches(string path) const
+{
+    if (m_empty) {
+        return false;
+    }
+    return matches(m_root.get(), splitPath(path), 0);
+}
+
+bool
+IgnoreList::matches(const Node *node,
+                    const vector<string> &components,
+                    size_t index) const
+{
+    if (index == components.size()) {
+        if (node->terminal) {
+            return true;
+        }
+        // A trailing ** may match no directories at all
+        return node->anyDepth && matches(node->anyDepth.get(),
+                                         components, index);
+    }
+
+    if (node->directory) {
+        return true;
+    }
+    
+    const string &component = components[index];
+
+    auto li = node->literals.find(component);
+    if (li != node->literals.end() &&
+        matches(li->second.get(), components, index + 1)) {
+        return true;
+    }
+
+    for (const auto &g: node->globs) {
+        if (globMatch(g.first, component) &&
+            matches(g.second.get(), components, index + 1)) {
+            return true;
+        }
+    }
+
+    if (node->anyDepth) {
+        // The ** may swallow any number of the remaining components
+        for (size_t i = index; i <= components.size(); ++i) {
+            if (matches(node->anyDepth.get(), components, i)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,102 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#ifndef IGNORE_LIST_H
+#define IGNORE_LIST_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+/**
+ * A list of libraries not to be checked, given as patterns and
+ * compiled into a trie of path components so that a path can be
+ * tested against any number of them in a single walk along it.
+ *
+ * Each pattern is one of:
+ *
+ *  - A full path, matching that library only
+ *
+ *  - A directory path ending in /, matching every library within
+ *    that directory or any directory below it
+ *
+ *  - A name with no / in it, matching a library of that name in any
+ *    directory
+ *
+ * Any component of these may be a glob, in which * matches any run
+ * of characters and ? any single character, neither of them across
+ * a /, and [...] matches any one of a set of characters ([!...] any
+ * other). A component that is exactly ** matches any number of
+ * directories, including none. So for example
+ * "/opt/vamp-plugins-1.?/broken.so" ignores broken.so in each 1.x
+ * version of that package installed in /opt, and "*-debug.so"
+ * ignores any library whose name ends in -debug.so.
+ *
+ * Every pattern also matches the path it spells out literally, so a
+ * library whose path happens to contain any of *, ?, [ or ] can
+ * still be ignored by giving its path exactly, as it could before
+ * patterns were supported. There is no escape character.
+ *
+ * Components without wildcards are looked up by hash at each level
+ * of the trie, so the time taken to test a path depends on the
+ * length of the path, and on how many wildcard components compete at
+ * the same level of the trie, but not on the number of literal
+ * paths and directories in the list.
+ *
+ * Immutable once constructed, and so safe to use from any thread.
+ */
+class IgnoreList
+{
+public:
+    IgnoreList(std::vector<std::string> patterns);
+    ~IgnoreList();
+
+    /** Return true if the given library path matches any pattern.
+     */
+    bool matches(std::string path) const;
+
+    /** Return true if there are no patterns.
+     */
+    bool empty() const;
+
+private:
+    IgnoreList(const IgnoreList &) = delete;
+    IgnoreList &operator=(const IgnoreList &) = delete;
+
+    struct Node;
+    std::unique_ptr<Node> m_root;
+    bool m_empty;
+
+    void add(std::string pattern, bool literal);
+    bool matches(const Node *node,
+                 const std::vector<std::string> &components,
+                 size_t index) const;
+};
+
+#endif
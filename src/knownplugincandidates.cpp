@@ -49,7 +49,9 @@ is32bit(string helperExecutableName)
 
 KnownPluginCandidates::KnownPluginCandidates(string helperExecutableName,
                                              stringlist librariesToIgnore,
-                                             PluginCandidates::LogCallback *cb) :
+                                             PluginCandidates::LogCallback *cb,
+                                             PluginCandidates::Options options,
+                                             PluginCandidates::ResultCallback *resultCallback) :
     m_known(is32bit(helperExecutableName) ?
             KnownPlugins::FormatNonNative32Bit :
             KnownPlugins::FormatNative),
@@ -57,14 +59,30 @@ KnownPluginCandidates::KnownPluginCandidates(string helperExecutableName,
     m_helperExecutableName(helperExecutableName)
 {
     m_candidates.setLogCallback(cb);
+    m_candidates.setOptions(options);
 
-    auto knownTypes = m_known.getKnownPluginTypes();
-        
-    for (auto type: knownTypes) {
-        m_candidates.scan(m_known.getTagFor(type),
-                          m_known.getPathFor(type),
-                          m_known.getDescriptorFor(type));
+    // Scan all types together, so that the helper only needs to run
+    // once and loads each library only once, and the directories for
+    // all types are listed concurrently
+    vector<PluginCandidates::ScanRequest> requests = getScanRequests();
+
+    if (resultCallback) {
+        m_candidates.scanAsync(requests, resultCallback);
+    } else {
+        m_candidates.scan(requests);
+    }
+}
+
+vector<PluginCandidates::ScanRequest>
+KnownPluginCandidates::getScanRequests() const
+{
+    vector<PluginCandidates::ScanRequest> requests;
+    for (auto type: m_known.getKnownPluginTypes()) {
+        requests.push_back({ m_known.getTagFor(type),
+                             m_known.getPathFor(type),
+                             m_known.getDescriptorFor(type) });
     }
+    return requests;
 }
 
 vector<pair<KnownPlugins::PluginType, PluginCandidates::FailureRec>>
@@ -28,17 +28,28 @@
 */
 
 #include "plugincandidates.h"
-
-#include "../version.h"
+#include "verdictcache.h"
+#include "resultparser.h"
+#include "helperprotocol.h"
+#include "plugincatalog.h"
+#include "helperprocess.h"
+#include "directorywatcher.h"
+#include "ignorelist.h"
+#include "tracer.h"
 
 #include <set>
 #include <stdexcept>
 #include <iostream>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <ctime>
 
 #include <QProcess>
 #include <QDir>
 #include <QElapsedTimer>
-#include <QRegularExpression>
 
 #if defined(_WIN32)
 #define PLUGIN_GLOB "*.dll"
@@ -50,14 +61,108 @@
 
 using namespace std;
 
+static string
+joinDescriptors(const vector<string> &descriptors)
+{
+    string list;
+    for (const auto &d: descriptors) {
+        if (list != "") list += ",";
+        list += d;
+    }
+    return list;
+}
+
+// Oldest helper version whose output we know how to read
+static const int minimumHelperVersion = 4;
+
+// First helper version supporting the --fork option
+static const int forkServerHelperVersion = 5;
+
+// First helper version supporting the --timeout option
+static const int timeoutHelperVersion = 6;
+
+// First helper version accepting more than one descriptor per library
+static const int multiDescriptorHelperVersion = 7;
+
+// First helper version supporting the --binary option
+static const int binaryProtocolHelperVersion = 8;
+
+// First helper version supporting the --plugin-info option
+static const int pluginInfoHelperVersion = 11;
+
+// First helper version supporting the --timings option
+static const int timingsHelperVersion = 12;
+
+// First helper version accepting the |quit command
+static const int quitCommandHelperVersion = 13;
+
+// First helper version supporting the --memory option
+static const int memoryHelperVersion = 14;
+
+// First helper version supporting the --result-fd option
+static const int resultFdHelperVersion = 15;
+
+// Descriptor on which such a helper is given its result pipe. Its
+// standard output is then discarded, so that nothing a plugin prints
+// can reach us.
+static const int helperResultFd = 3;
+
+// First helper version supporting the --trace option
+static const int traceHelperVersion = 16;
+
+// Compatibility versions obtained from helper executables by any
+// PluginCandidates object in this process, keyed by path and
+// validated by file identity, so that repeated scans need not each
+// start the helper just to ask it
+static mutex helperVersionMutex;
+static map<string, pair<FileIdentity, string>> helperVersions;
+
+// A crash or timeout, whether reported by the helper or by us on
+// finding that the helper stopped before reporting (in which case
+// the code is FAIL_OTHER), may be down to circumstances rather than
+// the library itself, so is worth trying again on the next scan
+// rather than caching
+static bool
+isCrash(PluginCheckCode code)
+{
+    return code == PluginCheckCode::FAIL_OTHER ||
+        code == PluginCheckCode::FAIL_CRASHED ||
+        code == PluginCheckCode::FAIL_TIMED_OUT;
+}
+
+// A library that can't be loaded for want of a dependency (which
+// dlopen may report only as FAIL_NOT_LOADABLE) will load once the
+// dependency is installed, without itself changing, so its verdict
+// is not cached either
+static bool
+isCacheable(PluginCheckCode code)
+{
+    return !isCrash(code) &&
+        code != PluginCheckCode::FAIL_DEPENDENCY_MISSING &&
+        code != PluginCheckCode::FAIL_NOT_LOADABLE;
+}
+
+// Longest quarantine, as a multiple of Options::quarantineDays
+static const int maxQuarantineMultiple = 4;
+
 PluginCandidates::PluginCandidates(string helperExecutableName,
                                    stringlist librariesToIgnore) :
     m_helper(helperExecutableName),
-    m_logCallback(nullptr)
+    m_toIgnore(new IgnoreList(librariesToIgnore)),
+    m_logCallback(nullptr),
+    m_asyncRunning(false),
+    m_scansRunning(0),
+    m_cancelled(false),
+    m_changeCallback(nullptr)
 {
-    for (auto library : librariesToIgnore) {
-        m_toIgnore.insert(library);
-    }
+}
+
+PluginCandidates::~PluginCandidates()
+{
+    stopWatching();
+    cancel();
+    waitForScans();
+    stopKeptHelpers();
 }
 
 void
@@ -66,9 +171,38 @@ PluginCandidates::setLogCallback(LogCallback *cb)
     m_logCallback = cb;
 }
 
+void
+PluginCandidates::setOptions(Options options)
+{
+    if (options.helperPoolSize < 1) {
+        options.helperPoolSize = 1;
+    }
+    if (options.cacheFile != m_options.cacheFile) {
+        lock_guard<mutex> guard(m_cacheMutex);
+        m_cache.reset();
+    }
+    if (!options.keepHelpers ||
+        options.useForkServer != m_options.useForkServer ||
+        options.libraryTimeout != m_options.libraryTimeout) {
+        stopKeptHelpers();
+    }
+    if (options.traceFile != m_options.traceFile) {
+        m_tracer.reset(options.traceFile == "" ? nullptr :
+                       new Tracer(options.traceFile));
+    }
+    m_options = options;
+}
+
+PluginCandidates::Options
+PluginCandidates::getOptions() const
+{
+    return m_options;
+}
+
 vector<string>
 PluginCandidates::getCandidateLibrariesFor(string tag) const
 {
+    lock_guard<mutex> guard(m_dataMutex);
     if (m_candidates.find(tag) == m_candidates.end()) return {};
     else return m_candidates.at(tag);
 }
@@ -76,13 +210,48 @@ PluginCandidates::getCandidateLibrariesFor(string tag) const
 vector<PluginCandidates::FailureRec>
 PluginCandidates::getFailedLibrariesFor(string tag) const
 {
+    lock_guard<mutex> guard(m_dataMutex);
     if (m_failures.find(tag) == m_failures.end()) return {};
     else return m_failures.at(tag);
 }
 
+vector<PluginCandidates::PluginInfo>
+PluginCandidates::getPluginsFor(string tag, string library) const
+{
+    lock_guard<mutex> guard(m_dataMutex);
+    auto i = m_plugins.find(tag);
+    if (i == m_plugins.end()) return {};
+    auto j = i->second.find(library);
+    if (j == i->second.end()) return {};
+    else return j->second;
+}
+
+PluginCandidates::Stats
+PluginCandidates::getStats() const
+{
+    lock_guard<mutex> guard(m_statsMutex);
+    return m_stats;
+}
+
+void
+PluginCandidates::resetStats()
+{
+    lock_guard<mutex> guard(m_statsMutex);
+    m_stats = Stats();
+}
+
+bool
+PluginCandidates::writeCatalog(string filename) const
+{
+    lock_guard<mutex> guard(m_dataMutex);
+    return PluginCatalog::write(filename, m_candidates, m_failures);
+}
+
 void
 PluginCandidates::log(string message)
 {
+    lock_guard<mutex> guard(m_logMutex);
+    
     if (m_logCallback) {
         m_logCallback->log("PluginCandidates: " + message);
     } else {
@@ -90,293 +259,1906 @@ PluginCandidates::log(string message)
     }
 }
 
-vector<string>
-PluginCandidates::getLibrariesInPath(vector<string> path)
+vector<vector<string>>
+PluginCandidates::getLibrariesInPaths(vector<vector<string>> paths,
+                                      map<string, FileIdentity> &identities)
 {
-    vector<string> candidates;
+    // Each distinct directory in any of the paths is listed once, by
+    // one of a few threads taking the directories in turn, as
+    // listing can be slow on network filesystems and the paths for
+    // different plugin types often overlap. There are no more
+    // threads than the hardware can run at once, however long the
+    // paths are. The
+    // identity of each file is obtained at the same time, both to
+    // spot the same file turning up under more than one directory
+    // (e.g. through a symlink) and for later use with the verdict
+    // cache.
 
-    for (string dirname: path) {
+    vector<string> dirs;
+    map<string, size_t> dirIndex;
+    for (const auto &path: paths) {
+        for (const auto &dir: path) {
+            if (dirIndex.find(dir) == dirIndex.end()) {
+                dirIndex[dir] = dirs.size();
+                dirs.push_back(dir);
+            }
+        }
+    }
+    
+    Tracer *tracer = m_tracer.get();
+    TraceSpan span(tracer, "list directories");
+    
+    vector<Listing> listings(dirs.size());
+    vector<exception_ptr> errors(dirs.size());
+    vector<thread> threads;
+    atomic<size_t> next(0);
 
-        log("Scanning directory " + dirname);
+    size_t threadCount = max(1u, thread::hardware_concurrency());
+    threadCount = min(threadCount, dirs.size());
+    
+    for (size_t t = 0; t < threadCount; ++t) {
+        threads.push_back(thread([this, tracer, &next,
+                                  &dirs, &listings, &errors]() {
+                    size_t i;
+                    while ((i = next++) < dirs.size()) {
+                        TraceSpan span(tracer, "list directory");
+                        try {
+                            set<FileKey> visited;
+                            listDirectory(dirs[i], m_options.directoryDepth,
+                                          visited, listings[i]);
+                        } catch (...) {
+                            errors[i] = current_exception();
+                        }
+                        if (span.active()) {
+                            span.setArgs
+                                ({ { "directory", dirs[i] },
+                                   { "libraries",
+                                     to_string(listings[i].size()) } });
+                        }
+                    }
+                }));
+    }
 
-        QDir dir(dirname.c_str(), PLUGIN_GLOB,
-                 QDir::Name | QDir::IgnoreCase,
-                 QDir::Files | QDir::Readable);
+    for (auto &t: threads) {
+        t.join();
+    }
+    span.end();
 
-        for (unsigned int i = 0; i < dir.count(); ++i) {
-            QString soname = dir.filePath(dir[i]);
-            // NB this means the library names passed to the helper
-            // are UTF-8 encoded
-            candidates.push_back(soname.toStdString());
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        if (errors[i]) {
+            rethrow_exception(errors[i]);
         }
     }
 
-    return candidates;
+    vector<vector<string>> result(paths.size());
+    
+    for (size_t p = 0; p < paths.size(); ++p) {
+        
+        vector<string> &candidates = result[p];
+        set<string> seenPaths;
+        set<FileKey> seenFiles;
+    
+        for (const auto &dir: paths[p]) {
+            for (const auto &entry: listings[dirIndex[dir]]) {
+                const string &library = entry.first;
+                const FileIdentity &id = entry.second;
+                if (!seenPaths.insert(library).second) {
+                    continue;
+                }
+                // No inode numbers on Windows, where only the path
+                // can be compared
+                if (id.valid && id.inode != 0 &&
+                    !seenFiles.insert({ id.device, id.inode }).second) {
+                    log("Skipping " + library +
+                        ", which is the same file as one found already");
+                    continue;
+                }
+                candidates.push_back(library);
+                identities[library] = id;
+            }
+        }
+    }
+
+    return result;
+}
+
+void
+PluginCandidates::listDirectory(string dirname, int depth,
+                                set<FileKey> &visited, Listing &listing)
+{
+    // Guard against symlink loops when descending
+    FileIdentity dirId = FileIdentity::of(dirname);
+    if (dirId.valid && dirId.inode != 0 &&
+        !visited.insert({ dirId.device, dirId.inode }).second) {
+        return;
+    }
+    
+    log("Scanning directory " + dirname);
+
+    QDir dir(dirname.c_str(), PLUGIN_GLOB,
+             QDir::Name | QDir::IgnoreCase,
+             QDir::Files | QDir::Readable);
+
+    for (unsigned int i = 0; i < dir.count(); ++i) {
+        QString soname = dir.filePath(dir[i]);
+        // NB this means the library names passed to the helper
+        // are UTF-8 encoded
+        string library = soname.toStdString();
+        listing.push_back({ library, FileIdentity::of(library) });
+    }
+
+    if (depth > 0) {
+        QDir subdirs(dirname.c_str(), "",
+                     QDir::Name | QDir::IgnoreCase,
+                     QDir::AllDirs | QDir::NoDotAndDotDot | QDir::Readable);
+        for (unsigned int i = 0; i < subdirs.count(); ++i) {
+            listDirectory(subdirs.filePath(subdirs[i]).toStdString(),
+                          depth - 1, visited, listing);
+        }
+    }
 }
 
 void
 PluginCandidates::scan(string tag,
                        vector<string> pluginPath,
-                       string descriptorSymbolName)
+                       string descriptorSymbolName,
+                       ResultCallback *callback)
 {
-    string helperVersion = getHelperCompatibilityVersion();
-    if (helperVersion != CHECKER_COMPATIBILITY_VERSION) {
-        log("Wrong plugin checker helper version found: expected v" +
-            string(CHECKER_COMPATIBILITY_VERSION) + ", found v" +
-            helperVersion);
-        throw runtime_error("wrong version of plugin load helper found");
+    scan({ { tag, pluginPath, descriptorSymbolName } }, callback);
+}
+
+void
+PluginCandidates::scan(vector<ScanRequest> requests,
+                       ResultCallback *callback)
+{
+    TraceSpan span(m_tracer.get(), "scan");
+    if (span.active()) {
+        string tags;
+        for (const auto &request: requests) {
+            tags += (tags == "" ? "" : ",") + request.tag;
+        }
+        span.setArgs({ { "tags", tags } });
     }
     
-    vector<string> libraries = getLibrariesInPath(pluginPath);
-    vector<string> remaining;
+    map<string, FileIdentity> identities;
+    vector<stringlist> paths;
+    for (const auto &request: requests) {
+        paths.push_back(request.pluginPath);
+    }
+    vector<stringlist> libraryLists = getLibrariesInPaths(paths, identities);
 
-    for (auto library : libraries) {
-        if (m_toIgnore.find(library) == m_toIgnore.end()) {
-            remaining.push_back(library);
-        } else {
-            m_failures[tag].push_back({
-                    library,
-                    PluginCheckCode::FAIL_ON_IGNORE_LIST,
-                    {}
-                });
+    checkLibraries(requests, libraryLists, identities, callback, true);
+
+    span.end();
+    writeTrace();
+}
+
+void
+PluginCandidates::checkLibraries(const vector<ScanRequest> &requests,
+                                 const vector<stringlist> &libraryLists,
+                                 map<string, FileIdentity> &identities,
+                                 ResultCallback *callback,
+                                 bool replaceTags)
+{
+    {
+        // A cancel() made when no scan was running has nothing to
+        // apply to
+        lock_guard<mutex> guard(m_asyncMutex);
+        if (!m_asyncRunning && m_scansRunning == 0) {
+            m_cancelled = false;
         }
+        ++m_scansRunning;
     }
 
-    int toTest = remaining.size();
-    int runlimit = 20;
-    int runcount = 0;
+    struct ScanCount {
+        PluginCandidates *pc;
+        ~ScanCount() {
+            lock_guard<mutex> guard(pc->m_asyncMutex);
+            --pc->m_scansRunning;
+        }
+    } scanCount { this };
+
+    QElapsedTimer timer;
+    timer.start();
     
-    vector<string> result;
+    ScanContext context;
+    context.callback = callback;
+
+    Tracer *tracer = m_tracer.get();
     
-    while (result.size() < toTest && runcount < runlimit) {
-        vector<string> output = runHelper(remaining, descriptorSymbolName);
-        result.insert(result.end(), output.begin(), output.end());
-        int shortfall = int(remaining.size()) - int(output.size());
-        if (shortfall > 0) {
-            // Helper bailed out for some reason presumably associated
-            // with the plugin following the last one it reported
-            // on. Add a failure entry for that one and continue with
-            // the following ones.
-            string failed = *(remaining.rbegin() + shortfall - 1);
-            log("Helper output ended before result for plugin " + failed);
-            result.push_back("FAILURE|" + failed + "|Plugin load check failed or timed out");
-            remaining = vector<string>
-                (remaining.rbegin(), remaining.rbegin() + shortfall - 1);
+    TraceSpan cacheSpan(tracer, "load verdict cache");
+    VerdictCache *cache = getVerdictCache();
+    cacheSpan.end();
+
+    TraceSpan versionSpan(tracer, "helper version");
+    string helperVersion = getHelperCompatibilityVersion(cache);
+    if (versionSpan.active()) {
+        versionSpan.setArgs({ { "version", helperVersion } });
+    }
+    versionSpan.end();
+    int version = 0;
+    try {
+        version = stoi(helperVersion);
+    } catch (const exception &) {
+    }
+    if (version < minimumHelperVersion) {
+        log("Wrong plugin checker helper version found: expected v" +
+            to_string(minimumHelperVersion) + " or newer, found v" +
+            helperVersion);
+        throw runtime_error("wrong version of plugin load helper found");
+    }
+    context.helperVersion = version;
+
+    if (replaceTags) {
+        // Any results from an earlier scan of the same tag are
+        // replaced by those from this one, including those for
+        // libraries that have since gone. (The watcher checks only
+        // the libraries that changed, and has already forgotten
+        // those.)
+        lock_guard<mutex> guard(m_dataMutex);
+        for (const auto &request: requests) {
+            m_candidates.erase(request.tag);
+            m_failures.erase(request.tag);
+            m_plugins.erase(request.tag);
         }
-        ++runcount;
     }
 
-    recordResult(tag, result);
-}
+    // Gather the libraries for all requests into a single list of
+    // jobs, one per library, each naming every descriptor to be
+    // looked up in that library. A library found in the paths for
+    // several requests is then loaded only once.
+    
+    VerdictMap verdicts;
+    vector<Job> jobs;
+    map<string, size_t> jobIndex;
+    set<string> quarantined;
+    int checkCount = 0;
+    long long now = time(nullptr);
 
-string
-PluginCandidates::getHelperCompatibilityVersion()
-{
-    QProcess process;
-    process.setReadChannel(QProcess::StandardOutput);
-    process.setProcessChannelMode(QProcess::ForwardedErrorChannel);
-    process.start(m_helper.c_str(), { "--version" });
+    TraceSpan gatherSpan(tracer, "gather libraries");
 
-    if (!process.waitForStarted()) {
-        QProcess::ProcessError err = process.error();
-        if (err == QProcess::FailedToStart) {
-            std::cerr << "Unable to start helper process " << m_helper
-                      << std::endl;
-        } else if (err == QProcess::Crashed) {
-            std::cerr << "Helper process " << m_helper
-                      << " crashed on startup" << std::endl;
-        } else {
-            std::cerr << "Helper process " << m_helper
-                      << " failed on startup with error code "
-                      << err << std::endl;
+    // The cache is shared with any other scans running at the same
+    // time, but is not needed while the helpers run
+    unique_lock<mutex> cacheLock(m_cacheMutex);
+    
+    for (size_t r = 0; r < requests.size(); ++r) {
+
+        const ScanRequest &request = requests[r];
+        string tag = request.tag;
+        string descriptor = request.descriptorSymbolName;
+        
+        for (auto library : libraryLists[r]) {
+            
+            if (m_toIgnore->matches(library)) {
+                reportVerdict(context, tag, library,
+                              { PluginCheckCode::FAIL_ON_IGNORE_LIST, {}, {} });
+                continue;
+            }
+            
+            CheckKey key(library, descriptor);
+            auto ti = context.tags.find(key);
+            if (ti != context.tags.end()) {
+                // Already being handled for another request
+                if (find(ti->second.begin(), ti->second.end(), tag) ==
+                    ti->second.end()) {
+                    ti->second.push_back(tag);
+                    auto vi = verdicts.find(key);
+                    if (vi != verdicts.end()) {
+                        reportVerdict(context, tag, library, vi->second);
+                    }
+                }
+                continue;
+            }
+            context.tags[key].push_back(tag);
+            ++checkCount;
+            
+            if (cache) {
+                // identities was filled in when the libraries were
+                // listed. A verdict stored by an earlier version that
+                // cached more codes is ignored.
+                Verdict verdict;
+                if (cache->lookup(library, descriptor,
+                                  identities[library], helperVersion,
+                                  verdict.code, verdict.message,
+                                  verdict.plugins) &&
+                    isCacheable(verdict.code)) {
+                    verdicts[key] = verdict;
+                    reportVerdict(context, tag, library, verdict);
+                    continue;
+                }
+            }
+
+            if (cache && m_options.quarantineDays > 0) {
+                VerdictCache::CrashRecord record;
+                if (cache->lookupCrashRecord(library, identities[library],
+                                             record) &&
+                    record.quarantinedUntil > now) {
+                    Verdict verdict { record.code,
+                                      "Not checked again since failing on "
+                                      "an earlier scan: " + record.message,
+                                      {} };
+                    verdicts[key] = verdict;
+                    reportVerdict(context, tag, library, verdict);
+                    quarantined.insert(library);
+                    continue;
+                }
+            }
+
+            auto ji = jobIndex.find(library);
+            if (ji == jobIndex.end()) {
+                jobIndex[library] = jobs.size();
+                jobs.push_back({ library, { descriptor } });
+            } else {
+                jobs[ji->second].descriptors.push_back(descriptor);
+            }
         }
-        throw runtime_error("plugin load helper failed to start");
     }
-    process.waitForFinished();
 
-    QByteArray output = process.readAllStandardOutput();
-    while (output.endsWith('\n') || output.endsWith('\r')) {
-        output.chop(1);
+    if (cache) {
+        log("Found cached verdicts for " +
+            to_string(verdicts.size()) + " of " +
+            to_string(checkCount) + " library checks");
     }
 
-    string versionString = QString(output).toStdString();
-    log("Read version string from helper: " + versionString);
-    return versionString;
-}
+    if (!quarantined.empty()) {
+        log("Skipping " + to_string(quarantined.size()) +
+            " quarantined libraries");
+    }
 
-vector<string>
-PluginCandidates::runHelper(vector<string> libraries, string descriptor)
-{
-    vector<string> output;
+    // Libraries that have crashed or hung the helper before, but are
+    // no longer quarantined, are checked after all the others so
+    // that they can't hold them up. Without the fork server a crash
+    // ends the helper run, so each is then checked in a run of its
+    // own and the others need never be restarted.
+    
+    vector<Job> safe, risky;
+    for (const auto &job: jobs) {
+        VerdictCache::CrashRecord record;
+        if (cache && cache->lookupCrashRecord(job.library,
+                                              identities[job.library],
+                                              record)) {
+            risky.push_back(job);
+        } else {
+            safe.push_back(job);
+        }
+    }
 
-    log("Running helper " + m_helper + " with following library list:");
-    for (auto &lib: libraries) log(lib);
+    if (!risky.empty()) {
+        log("Checking " + to_string(risky.size()) + " libraries that "
+            "have failed before after all the others");
+    }
 
-    QProcess process;
-    process.setReadChannel(QProcess::StandardOutput);
+    cacheLock.unlock();
+    if (gatherSpan.active()) {
+        gatherSpan.setArgs({ { "checks", to_string(checkCount) },
+                             { "cached", to_string(verdicts.size()) },
+                             { "jobs", to_string(jobs.size()) } });
+    }
+    gatherSpan.end();
 
-    if (m_logCallback) {
-        log("Log callback is set: using separate-channels mode to gather stderr");
-        process.setProcessChannelMode(QProcess::SeparateChannels);
-    } else {
-        process.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    TraceSpan runSpan(tracer, "run helpers");
+    VerdictList fresh;
+    if (usingForkServer(context)) {
+        safe.insert(safe.end(), risky.begin(), risky.end());
+        risky.clear();
     }
+    if (!safe.empty()) {
+        fresh = runJobs(safe, context);
+    }
+    for (const auto &job: risky) {
+        if (m_cancelled) {
+            break;
+        }
+        VerdictList output = runJobs({ job }, context);
+        fresh.insert(fresh.end(), output.begin(), output.end());
+    }
+    runSpan.end();
+
+    TraceSpan updateSpan(tracer, "update verdict cache");
+    cacheLock.lock();
     
-    process.start(m_helper.c_str(), { descriptor.c_str() });
-    
-    if (!process.waitForStarted()) {
-        QProcess::ProcessError err = process.error();
-        if (err == QProcess::FailedToStart) {
-            std::cerr << "Unable to start helper process " << m_helper
-                      << std::endl;
-        } else if (err == QProcess::Crashed) {
-            std::cerr << "Helper process " << m_helper
-                      << " crashed on startup" << std::endl;
+    // A library's crash record is updated once per scan, however
+    // many of its descriptors were lost with it
+    map<string, Verdict> failed;
+    set<string> succeeded;
+    for (const auto &v: fresh) {
+        const string &library = v.first.first;
+        if (isCrash(v.second.code)) {
+            failed[library] = v.second;
         } else {
-            std::cerr << "Helper process " << m_helper
-                      << " failed on startup with error code "
-                      << err << std::endl;
+            succeeded.insert(library);
+            if (cache && isCacheable(v.second.code)) {
+                cache->store(library, v.first.second,
+                             identities[library], helperVersion,
+                             v.second.code, v.second.message,
+                             v.second.plugins);
+            }
         }
-        logErrors(&process);
-        throw runtime_error("plugin load helper failed to start");
+        verdicts[v.first] = v.second;
     }
 
-    log("Helper " + m_helper + " started OK");
-    logErrors(&process);
-    
-    for (auto &lib: libraries) {
-        process.write(lib.c_str(), lib.size());
-        process.write("\n", 1);
+    if (cache) {
+        for (const auto &library: succeeded) {
+            if (failed.find(library) == failed.end()) {
+                cache->removeCrashRecord(library);
+            }
+        }
+        for (const auto &f: failed) {
+            const string &library = f.first;
+            VerdictCache::CrashRecord record;
+            if (!cache->lookupCrashRecord(library, identities[library],
+                                          record)) {
+                record.crashes = 0;
+            }
+            record.id = identities[library];
+            record.crashes++;
+            record.code = f.second.code;
+            record.message = f.second.message;
+            record.lastCrash = now;
+            record.quarantinedUntil = 0;
+            if (m_options.quarantineDays > 0) {
+                long long days = m_options.quarantineDays *
+                    min(record.crashes, maxQuarantineMultiple);
+                record.quarantinedUntil = now + days * 86400;
+                log("Quarantining library " + library + " for " +
+                    to_string(days) + " days after " +
+                    to_string(record.crashes) + " failed checks");
+            }
+            cache->storeCrashRecord(library, record);
+        }
     }
 
-    QElapsedTimer t;
-    t.start();
-    int timeout = 15000; // ms
+    if (cache && !cache->save()) {
+        log("Failed to write verdict cache file " + m_options.cacheFile);
+    }
+    cacheLock.unlock();
+    updateSpan.end();
 
-    const int buflen = 4096;
-    bool done = false;
-    
-    while (!done) {
-        char buf[buflen];
-        qint64 linelen = process.readLine(buf, buflen);
-        if (linelen > 0) {
-            output.push_back(buf);
-            done = (output.size() == libraries.size());
-        } else if (linelen < 0) {
-            // error case
-            log("Received error code while reading from helper");
-            done = true;
-        } else {
-            // no error, but no line read (could just be between
-            // lines, or could be eof)
-            done = (process.state() == QProcess::NotRunning);
-            if (!done) {
-                if (t.elapsed() > timeout) {
-                    // this is purely an emergency measure
-                    log("Timeout: helper took too long, killing it");
-                    process.kill();
-                    done = true;
-                } else {
-                    process.waitForReadyRead(200);
-                }
+    if (replaceTags) {
+        // Each verdict was recorded as soon as it was known, in
+        // whatever order the cache and the helpers produced them.
+        // Put them back into the order the libraries were found in.
+        lock_guard<mutex> guard(m_dataMutex);
+        for (size_t r = 0; r < requests.size(); ++r) {
+            map<string, size_t> position;
+            for (size_t i = 0; i < libraryLists[r].size(); ++i) {
+                position.insert({ libraryLists[r][i], i });
             }
+            stringlist &candidates = m_candidates[requests[r].tag];
+            stable_sort(candidates.begin(), candidates.end(),
+                        [&](const string &a, const string &b) {
+                            return position[a] < position[b];
+                        });
+            vector<FailureRec> &failures = m_failures[requests[r].tag];
+            stable_sort(failures.begin(), failures.end(),
+                        [&](const FailureRec &a, const FailureRec &b) {
+                            return position[a.library] < position[b.library];
+                        });
         }
-        logErrors(&process);
     }
 
-    if (process.state() != QProcess::NotRunning) {
-        process.close();
-        process.waitForFinished();
-        logErrors(&process);
+    {
+        lock_guard<mutex> guard(m_statsMutex);
+        for (const auto &request: requests) {
+            m_stats.scanTimes[request.tag] = timer.nsecsElapsed() / 1000;
+        }
     }
 
-    log("Helper completed");
-    
-    return output;
+    if (m_cancelled) {
+        log("Scan was cancelled");
+    }
 }
 
 void
-PluginCandidates::logErrors(QProcess *p)
+PluginCandidates::scanAsync(string tag,
+                            vector<string> pluginPath,
+                            string descriptorSymbolName,
+                            ResultCallback *callback)
 {
-    p->setReadChannel(QProcess::StandardError);
+    scanAsync({ { tag, pluginPath, descriptorSymbolName } }, callback);
+}
 
-    qint64 byteCount = p->bytesAvailable();
-    if (byteCount == 0) {
-        p->setReadChannel(QProcess::StandardOutput);
-        return;
-    }
+void
+PluginCandidates::scanAsync(vector<ScanRequest> requests,
+                            ResultCallback *callback)
+{
+    lock_guard<mutex> guard(m_asyncMutex);
 
-    QByteArray buffer = p->read(byteCount);
-    while (buffer.endsWith('\n') || buffer.endsWith('\r')) {
-        buffer.chop(1);
+    m_asyncQueue.push_back({ requests, callback });
+
+    if (!m_asyncRunning) {
+        // Any previous worker has already finished with the mutex by
+        // the time it clears m_asyncRunning, so this won't deadlock
+        if (m_asyncThread.joinable()) {
+            m_asyncThread.join();
+        }
+        m_cancelled = false;
+        m_asyncRunning = true;
+        m_asyncThread = thread([this]() { runAsyncScans(); });
     }
-    std::string str(buffer.constData(), buffer.size());
-    log("Helper stderr output follows:\n" + str);
-    log("Helper stderr output ends");
-    
-    p->setReadChannel(QProcess::StandardOutput);
 }
 
 void
-PluginCandidates::recordResult(string tag, vector<string> result)
+PluginCandidates::runAsyncScans()
 {
-    for (auto &r: result) {
+    while (true) {
 
-        QString s(r.c_str());
-        QStringList bits = s.split("|");
+        AsyncScan next;
+        {
+            lock_guard<mutex> guard(m_asyncMutex);
+            if (m_asyncQueue.empty()) {
+                m_asyncRunning = false;
+                return;
+            }
+            next = m_asyncQueue.front();
+            m_asyncQueue.pop_front();
+        }
 
-        log(("Read output line from helper: " + s.trimmed()).toStdString());
-        
-        if (bits.size() < 2 || bits.size() > 3) {
-            log("Invalid output line (wrong number of |-separated fields)");
-            continue;
+        if (!m_cancelled) {
+            try {
+                scan(next.requests, next.callback);
+            } catch (const exception &e) {
+                log(string("Scan failed: ") + e.what());
+            }
         }
 
-        string status = bits[0].toStdString();
-        
-        string library = bits[1].toStdString();
-        if (bits.size() == 2) {
-            library = bits[1].trimmed().toStdString();
+        if (next.callback) {
+            lock_guard<mutex> guard(m_callbackMutex);
+            for (const auto &request: next.requests) {
+                next.callback->scanFinished(request.tag, m_cancelled);
+            }
         }
+    }
+}
 
-        if (status == "SUCCESS") {
-            m_candidates[tag].push_back(library);
+void
+PluginCandidates::cancel()
+{
+    m_cancelled = true;
+}
 
-        } else if (status == "FAILURE") {
-        
-            QString messageAndCode = "";
-            if (bits.size() > 2) {
-                messageAndCode = bits[2].trimmed();
-            }
-
-            PluginCheckCode code = PluginCheckCode::FAIL_OTHER;
-            string message = "";
-
-            QRegularExpression codeRE("^(.*) *\\[([0-9]+)\\]$");
-            auto match = codeRE.match(messageAndCode);
-            if (match.hasMatch()) {
-                QStringList caps(match.capturedTexts());
-                if (caps.length() == 3) {
-                    message = caps[1].toStdString();
-                    code = PluginCheckCode(caps[2].toInt());
-                    log("Split failure report into message and failure code "
-                        + caps[2].toStdString());
-                } else {
-                    log("Unable to split out failure code from report");
-                }
-            } else {
-                log("Failure message does not give a failure code");
-            }
+void
+PluginCandidates::waitForScans()
+{
+    thread t;
+    {
+        lock_guard<mutex> guard(m_asyncMutex);
+        t = move(m_asyncThread);
+    }
+    if (t.joinable()) {
+        t.join();
+    }
+}
 
-            if (message == "") {
-                message = messageAndCode.toStdString();
-            }
+bool
+PluginCandidates::isScanning() const
+{
+    lock_guard<mutex> guard(m_asyncMutex);
+    return m_asyncRunning;
+}
 
-            m_failures[tag].push_back({ library, code, message });
+// Time for which a watched directory must be quiet before changes
+// in it are checked, so that libraries still being written are left
+// alone
+static const int watchSettleTime = 1000; // ms
 
-        } else {
-            log("Unexpected status \"" + status + "\" in output line");
+// True if the given file name matches PLUGIN_GLOB
+static bool
+isLibraryName(string name)
+{
+    for (auto &c: name) c = char(tolower(c));
+    string glob = PLUGIN_GLOB;
+    string::size_type index = 0;
+    while (index < glob.size()) {
+        string::size_type space = glob.find(' ', index);
+        if (space == string::npos) space = glob.size();
+        string suffix = glob.substr(index + 1, space - index - 1); // skip *
+        if (name.size() > suffix.size() &&
+            name.compare(name.size() - suffix.size(), string::npos,
+                         suffix) == 0) {
+            return true;
         }
+        index = space + 1;
     }
+    return false;
 }
 
+struct PluginCandidates::WatchListener : public DirectoryWatcher::Listener
+{
+    WatchListener(PluginCandidates *pc) : m_pc(pc), m_watcher(nullptr) { }
+
+    void filesChanged(vector<pair<string, string>> changes) override {
+        try {
+            m_pc->librariesChanged(changes, m_watcher);
+        } catch (const exception &e) {
+            m_pc->log(string("Check of changed libraries failed: ") +
+                      e.what());
+        }
+    }
+
+    PluginCandidates *m_pc;
+    DirectoryWatcher *m_watcher;
+};
+
+bool
+PluginCandidates::watch(vector<ScanRequest> requests,
+                        ChangeCallback *callback)
+{
+    stopWatching();
+
+    if (!DirectoryWatcher::isSupported()) {
+        log("Watching for changes is not supported on this platform");
+        return false;
+    }
+    
+    stringlist dirs;
+    {
+        lock_guard<mutex> guard(m_watchMutex);
+
+        m_watchRequests = requests;
+        m_changeCallback = callback;
+    
+        for (size_t r = 0; r < requests.size(); ++r) {
+            for (const auto &dir: requests[r].pluginPath) {
+                set<FileKey> visited;
+                map<string, int> found { { dir, m_options.directoryDepth } };
+                listSubdirectories(dir, m_options.directoryDepth,
+                                   visited, found);
+                for (const auto &d: found) {
+                    auto &w = m_watchedDirectories[d.first];
+                    if (find(w.requests.begin(), w.requests.end(), r) ==
+                        w.requests.end()) {
+                        w.requests.push_back(r);
+                    }
+                    w.depth = max(w.depth, d.second);
+                }
+            }
+        }
+
+        for (const auto &d: m_watchedDirectories) {
+            dirs.push_back(d.first);
+        }
+    }
+    
+    m_watchListener.reset(new WatchListener(this));
+    m_watcher.reset(new DirectoryWatcher(m_watchListener.get()));
+    m_watchListener->m_watcher = m_watcher.get();
+    if (!m_watcher->start(dirs, watchSettleTime)) {
+        log("Failed to watch any plugin directories for changes");
+        stopWatching();
+        return false;
+    }
+
+    log("Watching " + to_string(dirs.size()) +
+        " plugin directories for changes");
+    return true;
+}
+
+void
+PluginCandidates::stopWatching()
+{
+    // Stopping the watcher waits for any call to librariesChanged()
+    m_watcher.reset();
+    m_watchListener.reset();
+
+    lock_guard<mutex> guard(m_watchMutex);
+    m_watchRequests.clear();
+    m_watchedDirectories.clear();
+    m_changeCallback = nullptr;
+}
+
+void
+PluginCandidates::listSubdirectories(string dirname, int depth,
+                                     set<FileKey> &visited,
+                                     map<string, int> &dirs)
+{
+    // Each subdirectory is recorded with the number of levels below
+    // it that are still within the depth
+    FileIdentity dirId = FileIdentity::of(dirname);
+    if (depth <= 0 ||
+        (dirId.valid && dirId.inode != 0 &&
+         !visited.insert({ dirId.device, dirId.inode }).second)) {
+        return;
+    }
+    
+    QDir subdirs(dirname.c_str(), "",
+                 QDir::Name | QDir::IgnoreCase,
+                 QDir::AllDirs | QDir::NoDotAndDotDot | QDir::Readable);
+    for (unsigned int i = 0; i < subdirs.count(); ++i) {
+        string subdir = subdirs.filePath(subdirs[i]).toStdString();
+        dirs[subdir] = max(dirs[subdir], depth - 1);
+        listSubdirectories(subdir, depth - 1, visited, dirs);
+    }
+}
+
+void
+PluginCandidates::librariesChanged(vector<pair<string, string>> changes,
+                                   DirectoryWatcher *watcher)
+{
+    // Called from the watcher thread. For each request, every
+    // changed library found in its path is forgotten, and those that
+    // still exist are checked again as if newly found.
+
+    vector<ScanRequest> requests;
+    map<string, WatchedDirectory> watched;
+    ChangeCallback *callback = nullptr;
+    {
+        lock_guard<mutex> guard(m_watchMutex);
+
+        // A subdirectory created (or moved in) within the depth
+        // needs a watch of its own, and may already have libraries
+        // in it, so is treated as wholly changed once watched
+        vector<pair<string, string>> created;
+        for (const auto &c: changes) {
+            auto wi = m_watchedDirectories.find(c.first);
+            if (wi == m_watchedDirectories.end() || wi->second.depth <= 0 ||
+                isLibraryName(c.second)) {
+                continue;
+            }
+            WatchedDirectory parent = wi->second;
+            set<FileKey> visited;
+            map<string, int> found;
+            listSubdirectories(c.first, parent.depth, visited, found);
+            for (const auto &d: found) {
+                if (!watcher || !watcher->addDirectory(d.first)) {
+                    continue;
+                }
+                log("Watching new plugin directory " + d.first);
+                auto &w = m_watchedDirectories[d.first];
+                w.requests = parent.requests;
+                w.depth = d.second;
+                created.push_back({ d.first, "" });
+            }
+        }
+        changes.insert(changes.end(), created.begin(), created.end());
+        
+        requests = m_watchRequests;
+        watched = m_watchedDirectories;
+        callback = m_changeCallback;
+    }
+    
+    vector<set<string>> changed(requests.size());
+
+    for (const auto &c: changes) {
+        auto wi = watched.find(c.first);
+        if (wi == watched.end()) {
+            continue;
+        }
+        string prefix = c.first;
+        if (prefix.empty() || prefix.back() != '/') {
+            prefix += '/';
+        }
+        stringlist libraries;
+        if (c.second == "") {
+            // Anything in the directory may have changed: take
+            // everything now in it and everything we knew to be in
+            // it
+            set<FileKey> visited;
+            Listing listing;
+            listDirectory(c.first, 0, visited, listing);
+            for (const auto &entry: listing) {
+                libraries.push_back(entry.first);
+            }
+            lock_guard<mutex> guard(m_dataMutex);
+            for (auto r: wi->second.requests) {
+                const string &tag = requests[r].tag;
+                for (const auto &library: m_candidates[tag]) {
+                    libraries.push_back(library);
+                }
+                for (const auto &f: m_failures[tag]) {
+                    libraries.push_back(f.library);
+                }
+            }
+        } else if (isLibraryName(c.second)) {
+            libraries.push_back(prefix + c.second);
+        }
+        for (auto r: wi->second.requests) {
+            for (const auto &library: libraries) {
+                if (library.compare(0, prefix.size(), prefix) == 0 &&
+                    library.find('/', prefix.size()) == string::npos) {
+                    changed[r].insert(library);
+                }
+            }
+        }
+    }
+
+    vector<stringlist> libraryLists(requests.size());
+    map<string, FileIdentity> identities;
+    vector<set<string>> before(requests.size());
+    bool any = false;
+
+    for (size_t r = 0; r < requests.size(); ++r) {
+        if (changed[r].empty()) {
+            continue;
+        }
+        any = true;
+        before[r] = forgetLibraries(requests[r].tag, changed[r]);
+        for (const auto &library: changed[r]) {
+            FileIdentity id = FileIdentity::of(library);
+            if (id.valid) {
+                libraryLists[r].push_back(library);
+                identities[library] = id;
+            }
+        }
+        log("Checking " + to_string(libraryLists[r].size()) + " of " +
+            to_string(changed[r].size()) + " changed libraries for " +
+            requests[r].tag);
+    }
+
+    if (!any) {
+        return;
+    }
+    
+    checkLibraries(requests, libraryLists, identities, nullptr, false);
+    writeTrace();
+
+    for (size_t r = 0; r < requests.size(); ++r) {
+        const string &tag = requests[r].tag;
+        set<string> after;
+        {
+            lock_guard<mutex> guard(m_dataMutex);
+            for (const auto &library: m_candidates[tag]) {
+                if (changed[r].find(library) != changed[r].end()) {
+                    after.insert(library);
+                }
+            }
+        }
+        if (!callback) {
+            continue;
+        }
+        for (const auto &library: before[r]) {
+            callback->libraryRemoved(tag, library);
+        }
+        for (const auto &library: after) {
+            callback->libraryAdded(tag, library);
+        }
+    }
+}
+
+set<string>
+PluginCandidates::forgetLibraries(string tag, const set<string> &libraries)
+{
+    // Remove the given libraries from the results for a tag,
+    // returning those that were candidates
+    
+    lock_guard<mutex> guard(m_dataMutex);
+
+    set<string> forgotten;
+    
+    stringlist &candidates = m_candidates[tag];
+    for (auto i = candidates.begin(); i != candidates.end(); ) {
+        if (libraries.find(*i) != libraries.end()) {
+            forgotten.insert(*i);
+            m_plugins[tag].erase(*i);
+            i = candidates.erase(i);
+        } else {
+            ++i;
+        }
+    }
+
+    vector<FailureRec> &failures = m_failures[tag];
+    for (auto i = failures.begin(); i != failures.end(); ) {
+        if (libraries.find(i->library) != libraries.end()) {
+            i = failures.erase(i);
+        } else {
+            ++i;
+        }
+    }
+
+    return forgotten;
+}
+
+VerdictCache *
+PluginCandidates::getVerdictCache()
+{
+    lock_guard<mutex> guard(m_cacheMutex);
+    if (m_options.cacheFile == "") {
+        return nullptr;
+    }
+    if (!m_cache) {
+        m_cache.reset(new VerdictCache(m_options.cacheFile));
+        if (!m_cache->load()) {
+            log("Verdict cache file " + m_options.cacheFile +
+                " could not be read, starting with an empty cache");
+        }
+    }
+    return m_cache.get();
+}
+
+bool
+PluginCandidates::usingForkServer(const ScanContext &context) const
+{
+#ifdef _WIN32
+    return false;
+#else
+    return m_options.useForkServer &&
+        context.helperVersion >= forkServerHelperVersion;
+#endif
+}
+
+PluginCandidates::VerdictList
+PluginCandidates::runJobs(vector<Job> jobs, const ScanContext &context)
+{
+    if (context.helperVersion >= multiDescriptorHelperVersion) {
+        return runHelperPool(jobs, context);
+    } else {
+        return runHelperPoolPerDescriptor(jobs, context);
+    }
+}
+
+PluginCandidates::VerdictList
+PluginCandidates::runHelperPoolPerDescriptor(vector<Job> jobs,
+                                             const ScanContext &context)
+{
+    // For helpers that can only look up one descriptor per session:
+    // split the jobs into one set for each descriptor, in order of
+    // first appearance
+    
+    vector<string> descriptors;
+    for (const auto &job: jobs) {
+        for (const auto &d: job.descriptors) {
+            if (find(descriptors.begin(), descriptors.end(), d) ==
+                descriptors.end()) {
+                descriptors.push_back(d);
+            }
+        }
+    }
+
+    VerdictList result;
+    
+    for (const auto &d: descriptors) {
+        vector<Job> subset;
+        for (const auto &job: jobs) {
+            if (find(job.descriptors.begin(), job.descriptors.end(), d) !=
+                job.descriptors.end()) {
+                subset.push_back({ job.library, { d } });
+            }
+        }
+        VerdictList output = runHelperPool(subset, context);
+        result.insert(result.end(), output.begin(), output.end());
+    }
+
+    return result;
+}
+
+// One shard of a pool run: the jobs it has yet to report on, and
+// the state of the helper currently working through them
+struct PluginCandidates::HelperRun
+{
+    HelperRun() :
+        runs(0), keep(false), reused(false), libraries(0), expected(0),
+        resultsRead(0), jobNo(0), descriptorNo(0), nextInput(0),
+        inputSent(false), done(false), recycle(false), lastFatal(false),
+        haveTimings(false), haveMemory(false), bytesWritten(0), bytesRead(0), timeout(0),
+        tracePid(0), traceStart(0), lastResult(0) { }
+    
+    vector<Job> remaining;
+    VerdictList output;
+    int runs;
+
+    unique_ptr<HelperProcess> process;
+    unique_ptr<ResultParser> parser;
+    vector<string> options;
+    vector<string> descriptors;
+    bool keep;
+    bool reused;
+    int libraries;
+    size_t expected;
+    size_t resultsRead;
+    size_t jobNo;
+    size_t descriptorNo;
+    size_t nextInput;
+    string input;
+    bool inputSent;
+    bool done;
+    bool recycle;
+    bool lastFatal; // the latest result was a crash or timeout
+    vector<PluginInfo> plugins;
+    HelperTimings timings;
+    bool haveTimings;
+    HelperMemory memory;
+    bool haveMemory;
+    map<string, Stats::LibraryTimes> libraryTimes;
+    map<string, Stats::LibraryMemory> libraryMemory;
+    long long bytesWritten;
+    long long bytesRead;
+    QElapsedTimer sinceOutput;
+    int timeout;
+
+    // For the trace, if any: the helper's process ID, which is used
+    // as the thread ID of its row, and the times at which this run
+    // started and the helper last reported a result
+    long long tracePid;
+    long long traceStart;
+    long long lastResult;
+};
+
+// An idle helper, kept for a later batch (Options::keepHelpers)
+struct PluginCandidates::KeptHelper
+{
+    unique_ptr<HelperProcess> process;
+    vector<string> options;     // command-line options it was started with
+    vector<string> descriptors; // and the descriptors named after them
+    int helperVersion;
+    int libraries;              // number checked so far
+};
+
+PluginCandidates::VerdictList
+PluginCandidates::runHelperPool(vector<Job> jobs,
+                                const ScanContext &context)
+{
+    int shardCount = m_options.helperPoolSize;
+    if (shardCount > int(jobs.size())) {
+        shardCount = int(jobs.size());
+    }
+    if (shardCount < 1) {
+        shardCount = 1;
+    }
+
+    if (shardCount > 1) {
+        log("Splitting " + to_string(jobs.size()) + " libraries across " +
+            to_string(shardCount) + " helper processes");
+    }
+    
+    // Each shard is a contiguous run of the library list, so that
+    // concatenating the shard outputs in shard order gives the same
+    // ordering as a single helper would have produced. A crash in
+    // one shard is handled by restarting that shard's helper alone
+    // and does not hold up the others.
+
+    vector<HelperRun> runs(shardCount);
+    for (int i = 0; i < shardCount; ++i) {
+        size_t from = (jobs.size() * i) / shardCount;
+        size_t to = (jobs.size() * (i + 1)) / shardCount;
+        runs[i].remaining = vector<Job>(jobs.begin() + from, jobs.begin() + to);
+    }
+
+    runHelpers(runs, context);
+
+    VerdictList result;
+    for (const auto &run: runs) {
+        result.insert(result.end(), run.output.begin(), run.output.end());
+    }
+    return result;
+}
+
+// Bytes of library list to queue for a helper at a time: enough to
+// keep it busy, without holding the whole list in a pipe buffer
+static const size_t inputChunkSize = 16384;
+
+// Longest time to wait for helper I/O before checking whether the
+// scan has been cancelled
+static const int cancelCheckInterval = 200; // ms
+
+void
+PluginCandidates::runHelpers(vector<HelperRun> &runs,
+                             const ScanContext &context)
+{
+    // All the helpers are driven from this thread. Each pass starts
+    // a helper for any run that has jobs left and no helper (either
+    // because it has not started yet, or because its last helper
+    // ended early), then waits until at least one helper has output
+    // for us or room for more input, and serves all those that do.
+
+    Tracer *tracer = m_tracer.get();
+    int tid = (tracer ? tracer->currentThread() : 0);
+    
+    while (true) {
+
+        vector<HelperRun *> active;
+        vector<HelperProcess *> processes;
+        vector<bool> wantInput;
+        int wait = cancelCheckInterval;
+        
+        for (auto &run: runs) {
+            if (!run.process) {
+                if (run.remaining.empty() || m_cancelled) {
+                    continue;
+                }
+                startHelper(run, context);
+            }
+            active.push_back(&run);
+            processes.push_back(run.process.get());
+            wantInput.push_back(!run.inputSent);
+            int left = run.timeout - int(run.sinceOutput.elapsed());
+            wait = max(0, min(wait, left));
+        }
+
+        if (active.empty()) {
+            break;
+        }
+        
+        long long waitStart = (tracer ? Tracer::now() : 0);
+        HelperProcess::waitForAny(processes, wantInput, wait);
+        if (tracer) {
+            tracer->complete("wait for helpers", tid, waitStart,
+                             Tracer::now(),
+                             { { "timeout", to_string(wait) } });
+        }
+
+        for (auto run: active) {
+            writeToHelper(*run);
+            long long readStart = (tracer ? Tracer::now() : 0);
+            long long bytesBefore = run->bytesRead;
+            readFromHelper(*run, context);
+            if (tracer && run->bytesRead > bytesBefore) {
+                tracer->complete("read results", tid, readStart,
+                                 Tracer::now(),
+                                 { { "helper", to_string(run->tracePid) },
+                                   { "bytes", to_string(run->bytesRead -
+                                                        bytesBefore) } });
+            }
+            logErrors(*run);
+            if (!run->done && !run->process->isFinished()) {
+                if (m_cancelled) {
+                    log("Scan cancelled: killing helper");
+                    if (tracer) {
+                        tracer->instant("cancelled", int(run->tracePid),
+                                        Tracer::now());
+                    }
+                    run->process->kill();
+                } else if (run->sinceOutput.elapsed() > run->timeout) {
+                    // this is purely an emergency measure
+                    log("Timeout: helper took too long, killing it");
+                    if (tracer) {
+                        tracer->instant("timed out", int(run->tracePid),
+                                        Tracer::now());
+                    }
+                    run->process->kill();
+                }
+            }
+            if (run->done || run->process->isFinished()) {
+                finishHelper(*run, context);
+            }
+        }
+    }
+}
+
+void
+PluginCandidates::startHelper(HelperRun &run, const ScanContext &context)
+{
+    int helperVersion = context.helperVersion;
+
+    // The descriptors to name on the command line, and the number of
+    // results we expect back
+    run.descriptors.clear();
+    run.expected = 0;
+    for (const auto &job: run.remaining) {
+        for (const auto &d: job.descriptors) {
+            if (find(run.descriptors.begin(), run.descriptors.end(), d) ==
+                run.descriptors.end()) {
+                run.descriptors.push_back(d);
+            }
+        }
+        run.expected += job.descriptors.size();
+    }
+
+    vector<string> options;
+    if (usingForkServer(context)) {
+        options.push_back("--fork");
+    }
+    if (m_options.libraryTimeout > 0 &&
+        helperVersion >= timeoutHelperVersion) {
+        options.push_back("--timeout");
+        options.push_back(to_string(m_options.libraryTimeout));
+    }
+    bool binary = (helperVersion >= binaryProtocolHelperVersion);
+    if (binary) {
+        options.push_back("--binary");
+        if (helperVersion >= pluginInfoHelperVersion) {
+            options.push_back("--plugin-info");
+        }
+        if (helperVersion >= timingsHelperVersion) {
+            options.push_back("--timings");
+        }
+        if (helperVersion >= memoryHelperVersion) {
+            options.push_back("--memory");
+        }
+    }
+#ifndef _WIN32
+    bool resultFd = (helperVersion >= resultFdHelperVersion);
+    if (resultFd) {
+        options.push_back("--result-fd");
+        options.push_back(to_string(helperResultFd));
+    }
+#endif
+    Tracer *tracer = m_tracer.get();
+    if (tracer && helperVersion >= traceHelperVersion) {
+        options.push_back("--trace");
+        options.push_back(tracer->getHelperFile());
+    }
+
+    // A kept helper can only be given libraries with descriptors
+    // other than those on its command line if it accepts a list of
+    // them on each input line
+    run.keep = (m_options.keepHelpers &&
+                helperVersion >= multiDescriptorHelperVersion);
+    run.reused = false;
+    
+    unique_ptr<KeptHelper> kept;
+    if (run.keep) {
+        lock_guard<mutex> guard(m_keptHelpersMutex);
+        if (!m_keptHelpers.empty()) {
+            kept = move(m_keptHelpers.back());
+            m_keptHelpers.pop_back();
+        }
+    }
+    if (kept) {
+        // An idle helper has nothing to say, so any output (or the
+        // end of it) means something has gone wrong with it
+        char c;
+        if (kept->options != options ||
+            kept->helperVersion != helperVersion ||
+            kept->process->read(&c, 1) > 0 ||
+            kept->process->isFinished()) {
+            log("Kept helper is no longer usable: discarding it");
+            kept.reset();
+        }
+    }
+    
+    if (kept) {
+
+        log("Reusing helper " + m_helper + " with following library list:");
+        for (auto &job: run.remaining) log(job.library);
+
+        run.process = move(kept->process);
+        run.descriptors = kept->descriptors;
+        run.libraries = kept->libraries;
+        run.reused = true;
+        
+        lock_guard<mutex> guard(m_statsMutex);
+        ++m_stats.helperReuses;
+
+    } else {
+
+        log("Running helper " + m_helper + " with following library list:");
+        for (auto &job: run.remaining) log(job.library);
+
+        vector<string> args(options);
+        args.push_back(joinDescriptors(run.descriptors));
+
+        if (m_logCallback) {
+            log("Log callback is set: using separate-channels mode to gather stderr");
+        }
+    
+        TraceSpan span(tracer, "start helper");
+        if (span.active()) {
+            span.setArgs({ { "restart", run.runs > 0 ? "1" : "0" } });
+        }
+        
+        unique_ptr<HelperProcess> process(new HelperProcess);
+#ifndef _WIN32
+        if (resultFd) {
+            process->setOutputFd(helperResultFd);
+        }
+#endif
+        string error;
+        if (!process->start(m_helper, args, m_logCallback != nullptr, error)) {
+            std::cerr << "Unable to start helper process " << m_helper
+                      << ": " << error << std::endl;
+            throw runtime_error("plugin load helper failed to start");
+        }
+        span.end();
+
+        log("Helper " + m_helper + " started OK");
+
+        run.process = move(process);
+        run.libraries = 0;
+
+        lock_guard<mutex> guard(m_statsMutex);
+        ++m_stats.helperSpawns;
+        if (run.runs > 0) {
+            ++m_stats.helperRestarts;
+        }
+    }
+    
+    run.options = options;
+    run.parser.reset(new ResultParser(binary ?
+                                      ResultParser::Format::Binary :
+                                      ResultParser::Format::Text));
+    run.input.clear();
+    run.nextInput = 0;
+    run.inputSent = false;
+    run.jobNo = 0;
+    run.descriptorNo = 0;
+    run.resultsRead = 0;
+    run.done = (run.expected == 0);
+    run.recycle = false;
+    run.lastFatal = false;
+    run.plugins.clear();
+    run.haveTimings = false;
+    run.haveMemory = false;
+    run.bytesWritten = 0;
+    run.bytesRead = 0;
+    run.libraryTimes.clear();
+    run.libraryMemory.clear();
+    ++run.runs;
+
+    // This timeout is restarted whenever the helper reports a result,
+    // so it only needs to cover the slowest single library. If the
+    // helper is enforcing its own per-library budget, allow a margin
+    // on top of that for the helper to notice and report it.
+    run.timeout = 15000; // ms
+    if (m_options.libraryTimeout > 0 &&
+        helperVersion >= timeoutHelperVersion &&
+        m_options.libraryTimeout + 5000 > run.timeout) {
+        run.timeout = m_options.libraryTimeout + 5000;
+    }
+    run.sinceOutput.start();
+
+    if (tracer) {
+        run.tracePid = run.process->processId();
+        run.traceStart = run.lastResult = Tracer::now();
+        tracer->nameThread(int(run.tracePid),
+                           "helper " + to_string(run.tracePid));
+    }
+}
+
+void
+PluginCandidates::writeToHelper(HelperRun &run)
+{
+    // The library list is written a chunk at a time as the helper
+    // takes it. Unless the helper is to be kept for another batch,
+    // the pipe is closed after the last one so that the helper exits
+    // once it has reported on everything. A library whose
+    // descriptors differ from those on the helper's command line
+    // has them listed before it.
+    
+    while (!run.inputSent) {
+        if (run.input.empty()) {
+            while (run.nextInput < run.remaining.size() &&
+                   run.input.size() < inputChunkSize) {
+                const Job &job = run.remaining[run.nextInput++];
+                string line = job.library;
+                if (run.descriptors.size() > 1 ||
+                    job.descriptors != run.descriptors) {
+                    line = joinDescriptors(job.descriptors) + "|" + line;
+                }
+                run.input += line + "\n";
+            }
+            if (run.input.empty()) {
+                if (!run.keep) {
+                    run.process->closeInput();
+                }
+                run.inputSent = true;
+                break;
+            }
+        }
+        size_t n = run.process->write(run.input.data(), run.input.size());
+        if (n == 0) {
+            break;
+        }
+        run.bytesWritten += n;
+        run.input.erase(0, n);
+    }
+}
+
+void
+PluginCandidates::readFromHelper(HelperRun &run,
+                                 const ScanContext &context)
+{
+    // Output is read straight into the parser's buffer in whatever
+    // chunks it arrives in, and results are taken from the front of
+    // it as soon as they are complete, so no length limit applies to
+    // a single result
+    const int buflen = 4096;
+
+    ResultParser &parser = *run.parser;
+    
+    while (!run.done) {
+        size_t len = run.process->read(parser.reserve(buflen), buflen);
+        if (len == 0) {
+            break;
+        }
+        run.bytesRead += len;
+        run.sinceOutput.restart();
+        parser.commit(len);
+        ResultParser::Result result;
+        ResultParser::Status status;
+        while (!run.done &&
+               (status = parser.next(result)) !=
+               ResultParser::Status::Incomplete) {
+            if (status == ResultParser::Status::Corrupt) {
+                log("Invalid binary record from helper: killing it");
+                run.process->kill();
+                run.done = true;
+                break;
+            }
+            if (status == ResultParser::Status::Skipped) {
+                log("Skipped invalid output line from helper");
+                continue;
+            }
+            if (result.kind == ResultParser::Kind::Plugin) {
+                // Held until the verdict that follows it
+                const char *end = result.message + result.messageLength;
+                const char *nul = (const char *)
+                    memchr(result.message, '\0', result.messageLength);
+                if (!nul) nul = end;
+                run.plugins.push_back({ string(result.message, nul),
+                                        string(nul == end ? end : nul + 1,
+                                               end),
+                                        int(result.code) });
+                continue;
+            }
+            if (result.kind == ResultParser::Kind::Timings) {
+                // Likewise
+                if (result.messageLength == sizeof(run.timings)) {
+                    memcpy(&run.timings, result.message,
+                           sizeof(run.timings));
+                    run.haveTimings = true;
+                }
+                continue;
+            }
+            if (result.kind == ResultParser::Kind::Memory) {
+                // Likewise
+                if (result.messageLength == sizeof(run.memory)) {
+                    memcpy(&run.memory, result.message, sizeof(run.memory));
+                    run.haveMemory = true;
+                }
+                continue;
+            }
+            if (run.jobNo < run.remaining.size()) {
+                const Job &job = run.remaining[run.jobNo];
+                if (job.library.compare(0, string::npos, result.library,
+                                        result.libraryLength) != 0) {
+                    // We have lost track of which result is which, so
+                    // treat this as a failure on the library we were
+                    // expecting, and carry on with those after it in
+                    // a new helper
+                    log("Helper reported on library \"" +
+                        string(result.library, result.libraryLength) +
+                        "\" when expecting \"" + job.library +
+                        "\": killing it");
+                    run.process->kill();
+                    run.done = true;
+                    break;
+                }
+                CheckKey key(job.library, job.descriptors[run.descriptorNo]);
+                run.output.push_back({ key, { result.code,
+                                              string(result.message,
+                                                     result.messageLength),
+                                              move(run.plugins) } });
+                const Verdict &verdict = run.output.back().second;
+                if (Tracer *tracer = m_tracer.get()) {
+                    // Shown on the helper's row, as the time since
+                    // its previous result
+                    long long now = Tracer::now();
+                    string tags;
+                    auto ti = context.tags.find(key);
+                    if (ti != context.tags.end()) {
+                        for (const auto &tag: ti->second) {
+                            tags += (tags == "" ? "" : ",") + tag;
+                        }
+                    }
+                    tracer->complete(job.library, int(run.tracePid),
+                                     run.lastResult, now,
+                                     { { "descriptor", key.second },
+                                       { "tags", tags },
+                                       { "code",
+                                         to_string(int(verdict.code)) } });
+                    run.lastResult = now;
+                }
+                run.lastFatal =
+                    (verdict.code == PluginCheckCode::FAIL_CRASHED ||
+                     verdict.code == PluginCheckCode::FAIL_TIMED_OUT);
+                reportVerdict(context, key, verdict);
+                if (run.haveTimings) {
+                    // Whole-library times are repeated for each
+                    // descriptor, except those found missing without
+                    // loading the library
+                    const HelperTimings &timings = run.timings;
+                    Stats::LibraryTimes &lt = run.libraryTimes[job.library];
+                    lt.inspect = max<long long>(lt.inspect, timings.inspect);
+                    lt.open = max<long long>(lt.open, timings.open);
+                    lt.lookup += timings.lookup;
+                    lt.walk += timings.walk;
+                    lt.close = max<long long>(lt.close, timings.close);
+                    lt.total = max<long long>(lt.total, timings.total);
+                }
+                if (run.haveMemory) {
+                    // Only libraries that were actually loaded have
+                    // anything to report beyond the helper's size
+                    const HelperMemory &memory = run.memory;
+                    if (memory.residentBefore > 0) {
+                        run.libraryMemory[job.library] = {
+                            memory.residentAfter - memory.residentBefore,
+                            int(memory.mappingsAfter - memory.mappingsBefore),
+                            memory.stillMapped != 0
+                        };
+                    }
+                    if (m_options.helperMemoryLimit > 0 &&
+                        memory.helperResident >
+                        m_options.helperMemoryLimit * 1048576LL) {
+                        run.recycle = true;
+                    }
+                }
+                if (++run.descriptorNo == job.descriptors.size()) {
+                    run.descriptorNo = 0;
+                    ++run.jobNo;
+                }
+            }
+            run.plugins.clear();
+            run.haveTimings = false;
+            run.haveMemory = false;
+            run.done = (++run.resultsRead == run.expected);
+            if (run.recycle && !run.done && run.descriptorNo == 0) {
+                // Stop between libraries, and carry on with the rest
+                // in a new helper
+                log("Helper has grown to " +
+                    to_string(run.memory.helperResident / 1048576) +
+                    " MB: replacing it");
+                if (Tracer *tracer = m_tracer.get()) {
+                    tracer->instant("too large", int(run.tracePid),
+                                    Tracer::now(),
+                                    { { "resident",
+                                        to_string(run.memory.helperResident) }
+                                    });
+                }
+                run.process->kill();
+                return;
+            }
+        }
+    }
+}
+
+void
+PluginCandidates::finishHelper(HelperRun &run,
+                               const ScanContext &context)
+{
+    // A helper that has reported on everything may be kept for the
+    // next batch. Otherwise dropping the process kills it if it is
+    // still running, for example because it has reported everything
+    // but not yet exited.
+    logErrors(run);
+    run.libraries += int(run.jobNo);
+    if (run.keep && run.done && !run.recycle && !m_cancelled &&
+        !run.process->isFinished()) {
+        keepHelper(run, context);
+    }
+    run.process.reset();
+    
+    log("Helper completed");
+
+    if (Tracer *tracer = m_tracer.get()) {
+        string outcome =
+            m_cancelled ? "cancelled" :
+            run.done ? "finished" :
+            run.recycle ? "replaced" :
+            "ended early";
+        tracer->complete("helper run", int(run.tracePid),
+                         run.traceStart, Tracer::now(),
+                         { { "libraries", to_string(run.jobNo) },
+                           { "results", to_string(run.resultsRead) },
+                           { "reused", run.reused ? "1" : "0" },
+                           { "outcome", outcome } });
+    }
+
+    {
+        lock_guard<mutex> guard(m_statsMutex);
+        m_stats.bytesToHelper += run.bytesWritten;
+        m_stats.bytesFromHelper += run.bytesRead;
+        for (const auto &lt: run.libraryTimes) {
+            m_stats.libraries[lt.first] = lt.second;
+        }
+        for (const auto &lm: run.libraryMemory) {
+            m_stats.memory[lm.first] = lm.second;
+        }
+        if (run.recycle) {
+            ++m_stats.helperRecycles;
+        }
+    }
+
+    if (m_cancelled) {
+        run.remaining.clear();
+        return;
+    }
+
+    if (run.reused && run.resultsRead == 0 && !run.done) {
+        // A kept helper that ends before reporting anything may have
+        // been killed while it was idle. Don't blame the library for
+        // that: if it really is at fault, it will bring down the new
+        // helper as well.
+        log("Kept helper ended before reporting on anything: starting a new one");
+        return;
+    }
+
+    // The helper reports on each job's descriptors in order, so we
+    // know how far through the jobs it got
+    size_t completed = run.jobNo;
+    size_t reported = run.descriptorNo;
+    if (completed == run.remaining.size()) {
+        run.remaining.clear();
+        return;
+    }
+
+    if (run.recycle) {
+        // Stopped for growing too large, not for failing
+        run.remaining = vector<Job>
+            (run.remaining.begin() + completed, run.remaining.end());
+        return;
+    }
+
+    if (run.lastFatal && reported == 0) {
+        // A helper checking in-process reports the crash or timeout
+        // that ends it before exiting, so the library it has
+        // reported on is the culprit and the one after it is not to
+        // blame
+        log("Helper ended after reporting a crash or timeout: starting a new one");
+        run.remaining = vector<Job>
+            (run.remaining.begin() + completed, run.remaining.end());
+        return;
+    }
+    
+    // Helper bailed out for some reason presumably associated with
+    // the plugin following the last one it reported on. Add failure
+    // entries for that one and continue with the following ones in
+    // a new helper. Every restart either drops a job or follows at
+    // least one result, so this terminates after at most two
+    // helpers per job.
+    const Job &failed = run.remaining[completed];
+    log("Helper output ended before result for plugin " + failed.library);
+    if (Tracer *tracer = m_tracer.get()) {
+        tracer->instant("library blamed", int(run.tracePid), Tracer::now(),
+                        { { "library", failed.library } });
+    }
+    Verdict verdict { PluginCheckCode::FAIL_OTHER,
+                      "Plugin load check failed or timed out", {} };
+    for (size_t i = reported; i < failed.descriptors.size(); ++i) {
+        CheckKey key(failed.library, failed.descriptors[i]);
+        reportVerdict(context, key, verdict);
+        run.output.push_back({ key, verdict });
+    }
+    run.remaining = vector<Job>
+        (run.remaining.begin() + completed + 1, run.remaining.end());
+}
+
+void
+PluginCandidates::logErrors(HelperRun &run)
+{
+    string str = run.process->readErrors();
+    while (!str.empty() && (str.back() == '\n' || str.back() == '\r')) {
+        str.pop_back();
+    }
+    if (str.empty()) {
+        return;
+    }
+    log("Helper stderr output follows:\n" + str);
+    log("Helper stderr output ends");
+}
+
+void
+PluginCandidates::keepHelper(HelperRun &run, const ScanContext &context)
+{
+    unique_ptr<KeptHelper> kept(new KeptHelper);
+    kept->process = move(run.process);
+    kept->options = run.options;
+    kept->descriptors = run.descriptors;
+    kept->helperVersion = context.helperVersion;
+    kept->libraries = run.libraries;
+
+    vector<unique_ptr<KeptHelper>> toStop;
+
+    if (Tracer *tracer = m_tracer.get()) {
+        tracer->instant("kept", int(run.tracePid), Tracer::now(),
+                        { { "libraries", to_string(kept->libraries) } });
+    }
+    
+    if (m_options.helperLibraryLimit > 0 &&
+        kept->libraries >= m_options.helperLibraryLimit) {
+        log("Helper has checked " + to_string(kept->libraries) +
+            " libraries: shutting it down");
+        toStop.push_back(move(kept));
+    } else {
+        lock_guard<mutex> guard(m_keptHelpersMutex);
+        if (int(m_keptHelpers.size()) < m_options.helperPoolSize) {
+            log("Keeping helper for the next batch");
+            m_keptHelpers.push_back(move(kept));
+        } else {
+            toStop.push_back(move(kept));
+        }
+    }
+
+    stopHelpers(move(toStop));
+}
+
+// Time allowed for kept helpers to exit when asked to, before they
+// are killed
+static const int helperShutdownTimeout = 2000; // ms
+
+void
+PluginCandidates::stopHelpers(vector<unique_ptr<KeptHelper>> helpers)
+{
+    // Ask all the helpers to quit at once and then give them a moment
+    // to do so. Any still running after that are killed as they are
+    // dropped.
+
+    if (helpers.empty()) {
+        return;
+    }
+
+    TraceSpan span(m_tracer.get(), "stop helpers");
+    if (span.active()) {
+        span.setArgs({ { "helpers", to_string(helpers.size()) } });
+    }
+    
+    static const char quit[] = "|quit\n";
+    for (auto &h: helpers) {
+        if (h->helperVersion >= quitCommandHelperVersion) {
+            h->process->write(quit, sizeof(quit) - 1);
+        }
+        h->process->closeInput();
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    while (true) {
+        vector<HelperProcess *> running;
+        for (auto &h: helpers) {
+            char buffer[1024];
+            while (h->process->read(buffer, sizeof(buffer)) > 0) ;
+            if (!h->process->isFinished()) {
+                running.push_back(h->process.get());
+            }
+        }
+        int left = helperShutdownTimeout - int(timer.elapsed());
+        if (running.empty() || left <= 0) {
+            break;
+        }
+        HelperProcess::waitForAny(running, vector<bool>(running.size(), false),
+                                  left);
+    }
+
+    log("Shut down " + to_string(helpers.size()) + " helper(s)");
+}
+
+void
+PluginCandidates::writeTrace()
+{
+    if (m_tracer && !m_tracer->write()) {
+        log("Failed to write trace file " + m_options.traceFile);
+    }
+}
+
+void
+PluginCandidates::stopKeptHelpers()
+{
+    vector<unique_ptr<KeptHelper>> helpers;
+    {
+        lock_guard<mutex> guard(m_keptHelpersMutex);
+        helpers.swap(m_keptHelpers);
+    }
+    stopHelpers(move(helpers));
+}
+
+string
+PluginCandidates::getHelperCompatibilityVersion(VerdictCache *cache)
+{
+    // We can only be sure which file will be run if we were given a
+    // path to it: a bare name is looked up in the PATH by QProcess
+    bool hasPath = (m_helper.find('/') != string::npos);
+#ifdef _WIN32
+    hasPath = hasPath || (m_helper.find('\\') != string::npos);
+#endif
+    FileIdentity id;
+    if (hasPath) {
+        id = FileIdentity::of(m_helper);
+    }
+    if (!id.valid) {
+        return queryHelperCompatibilityVersion();
+    }
+
+    string version;
+    bool found = false;
+    {
+        lock_guard<mutex> guard(helperVersionMutex);
+        auto i = helperVersions.find(m_helper);
+        if (i != helperVersions.end() && i->second.first == id) {
+            version = i->second.second;
+            found = true;
+        }
+    }
+    if (!found && cache) {
+        lock_guard<mutex> guard(m_cacheMutex);
+        found = cache->lookupHelperVersion(m_helper, id, version);
+    }
+    if (found) {
+        log("Using known version string for helper: " + version);
+    } else {
+        version = queryHelperCompatibilityVersion();
+    }
+
+    {
+        lock_guard<mutex> guard(helperVersionMutex);
+        helperVersions[m_helper] = { id, version };
+    }
+    if (cache) {
+        lock_guard<mutex> guard(m_cacheMutex);
+        cache->storeHelperVersion(m_helper, id, version);
+    }
+    
+    return version;
+}
+
+string
+PluginCandidates::queryHelperCompatibilityVersion()
+{
+    TraceSpan span(m_tracer.get(), "query helper version");
+    
+    QProcess process;
+    process.setReadChannel(QProcess::StandardOutput);
+    process.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    process.start(m_helper.c_str(), { "--version" });
+
+    if (!process.waitForStarted()) {
+        QProcess::ProcessError err = process.error();
+        if (err == QProcess::FailedToStart) {
+            std::cerr << "Unable to start helper process " << m_helper
+                      << std::endl;
+        } else if (err == QProcess::Crashed) {
+            std::cerr << "Helper process " << m_helper
+                      << " crashed on startup" << std::endl;
+        } else {
+            std::cerr << "Helper process " << m_helper
+                      << " failed on startup with error code "
+                      << err << std::endl;
+        }
+        throw runtime_error("plugin load helper failed to start");
+    }
+    process.waitForFinished();
+
+    QByteArray output = process.readAllStandardOutput();
+    while (output.endsWith('\n') || output.endsWith('\r')) {
+        output.chop(1);
+    }
+
+    string versionString = QString(output).toStdString();
+    log("Read version string from helper: " + versionString);
+    return versionString;
+}
+
+void
+PluginCandidates::reportVerdict(const ScanContext &context,
+                                const string &tag,
+                                const string &library,
+                                const Verdict &verdict)
+{
+    // Recorded at once, so that the results of a scan in progress
+    // can be queried as they arrive
+    recordVerdict(tag, library, verdict);
+    
+    if (!context.callback) {
+        return;
+    }
+    lock_guard<mutex> guard(m_callbackMutex);
+    context.callback->libraryChecked(tag, library,
+                                     verdict.code, verdict.message);
+}
+
+void
+PluginCandidates::reportVerdict(const ScanContext &context,
+                                const CheckKey &key,
+                                const Verdict &verdict)
+{
+    auto i = context.tags.find(key);
+    if (i == context.tags.end()) {
+        return;
+    }
+    for (const auto &tag: i->second) {
+        reportVerdict(context, tag, key.first, verdict);
+    }
+}
+
+void
+PluginCandidates::recordVerdict(const string &tag, const string &library,
+                                const Verdict &verdict)
+{
+    lock_guard<mutex> guard(m_dataMutex);
+    if (verdict.code == PluginCheckCode::SUCCESS) {
+        m_candidates[tag].push_back(library);
+        if (!verdict.plugins.empty()) {
+            m_plugins[tag][library] = verdict.plugins;
+        }
+    } else {
+        m_failures[tag].push_back({ library, verdict.code, verdict.message });
+    }
+}
@@ -0,0 +1,481 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#include "plugincatalog.h"
+
+#include <QFile>
+#include <QSaveFile>
+
+#include <set>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+// The catalog consists of a header, the tag table, the string index,
+// the candidate and failure arrays for every tag, and finally the
+// string data. All offsets are in bytes from the start of the file,
+// and all numbers are 32-bit and in native byte order. Strings are
+// referred to by their position in the string index, which is sorted
+// by string content, so that the candidate and failure arrays, which
+// are sorted by string index, are in order of library path as well.
+
+static const char catalogMagic[16] = "vamp-plugin-cat";
+static const uint32_t catalogFormatVersion = 1;
+static const uint32_t catalogByteOrderMark = 0x01020304;
+
+struct CatalogHeader {
+    char magic[16];
+    uint32_t formatVersion;
+    uint32_t byteOrderMark;
+    uint32_t fileSize;
+    uint32_t tagCount;
+    uint32_t tagOffset;
+    uint32_t stringCount;
+    uint32_t stringIndexOffset;
+    uint32_t stringDataOffset;
+};
+
+struct CatalogTag {
+    uint32_t name;
+    uint32_t candidateCount;
+    uint32_t candidateOffset;
+    uint32_t failureCount;
+    uint32_t failureOffset;
+};
+
+struct CatalogFailure {
+    uint32_t library;
+    int32_t code;
+    uint32_t message;
+};
+
+static_assert(sizeof(CatalogHeader) == 48 &&
+              sizeof(CatalogTag) == 20 &&
+              sizeof(CatalogFailure) == 12,
+              "catalog structures must have no padding");
+
+PluginCatalog::PluginCatalog() :
+    m_data(nullptr),
+    m_size(0)
+{
+}
+
+PluginCatalog::~PluginCatalog()
+{
+    close();
+}
+
+bool
+PluginCatalog::open(string filename)
+{
+    close();
+    
+    m_file.reset(new QFile(QString::fromUtf8(filename.c_str())));
+    if (!m_file->open(QIODevice::ReadOnly)) {
+        m_file.reset();
+        return false;
+    }
+
+    qint64 size = m_file->size();
+    if (size < qint64(sizeof(CatalogHeader)) || size > qint64(UINT32_MAX)) {
+        close();
+        return false;
+    }
+    
+    m_data = m_file->map(0, size);
+    m_size = size_t(size);
+
+    if (!m_data || !validate()) {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void
+PluginCatalog::close()
+{
+    if (m_file) {
+        if (m_data) {
+            m_file->unmap(const_cast<unsigned char *>(m_data));
+        }
+        m_file->close();
+        m_file.reset();
+    }
+    m_data = nullptr;
+    m_size = 0;
+}
+
+bool
+PluginCatalog::isOpen() const
+{
+    return m_data != nullptr;
+}
+
+bool
+PluginCatalog::validate() const
+{
+    // Check everything that a query might rely on, once, so that
+    // queries need check nothing
+
+    const CatalogHeader *h = (const CatalogHeader *)m_data;
+    
+    if (memcmp(h->magic, catalogMagic, sizeof(catalogMagic)) != 0 ||
+        h->formatVersion != catalogFormatVersion ||
+        h->byteOrderMark != catalogByteOrderMark ||
+        h->fileSize != m_size) {
+        return false;
+    }
+
+    auto fits = [&](uint32_t offset, uint32_t count, size_t size) {
+        return offset % 4 == 0 && offset <= m_size &&
+            uint64_t(count) * size <= m_size - offset;
+    };
+
+    if (!fits(h->tagOffset, h->tagCount, sizeof(CatalogTag)) ||
+        !fits(h->stringIndexOffset, h->stringCount, sizeof(uint32_t)) ||
+        h->stringDataOffset >= m_size ||
+        m_data[m_size - 1] != '\0') {
+        return false;
+    }
+
+    // Every string must start within the string data, which ends
+    // with a nul, so every string is terminated within the file
+    const uint32_t *strings = (const uint32_t *)at(h->stringIndexOffset);
+    for (uint32_t i = 0; i < h->stringCount; ++i) {
+        if (strings[i] < h->stringDataOffset || strings[i] >= m_size) {
+            return false;
+        }
+    }
+
+    const CatalogTag *tags = (const CatalogTag *)at(h->tagOffset);
+    for (uint32_t t = 0; t < h->tagCount; ++t) {
+        const CatalogTag &tag = tags[t];
+        if (tag.name >= h->stringCount ||
+            !fits(tag.candidateOffset, tag.candidateCount,
+                  sizeof(uint32_t)) ||
+            !fits(tag.failureOffset, tag.failureCount,
+                  sizeof(CatalogFailure))) {
+            return false;
+        }
+        const uint32_t *candidates = (const uint32_t *)at(tag.candidateOffset);
+        for (uint32_t i = 0; i < tag.candidateCount; ++i) {
+            if (candidates[i] >= h->stringCount) {
+                return false;
+            }
+        }
+        const CatalogFailure *failures =
+            (const CatalogFailure *)at(tag.failureOffset);
+        for (uint32_t i = 0; i < tag.failureCount; ++i) {
+            if (failures[i].library >= h->stringCount ||
+                failures[i].message >= h->stringCount) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+const char *
+PluginCatalog::stringAt(uint32_t index) const
+{
+    const CatalogHeader *h = (const CatalogHeader *)m_data;
+    const uint32_t *strings = (const uint32_t *)at(h->stringIndexOffset);
+    return (const char *)at(strings[index]);
+}
+
+int
+PluginCatalog::findString(const char *s) const
+{
+    const CatalogHeader *h = (const CatalogHeader *)m_data;
+    int lo = 0, hi = int(h->stringCount);
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int c = strcmp(stringAt(mid), s);
+        if (c == 0) return mid;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+int
+PluginCatalog::getTagCount() const
+{
+    if (!m_data) return 0;
+    return int(((const CatalogHeader *)m_data)->tagCount);
+}
+
+const char *
+PluginCatalog::getTagName(int tag) const
+{
+    if (tag < 0 || tag >= getTagCount()) return nullptr;
+    const CatalogHeader *h = (const CatalogHeader *)m_data;
+    return stringAt(((const CatalogTag *)at(h->tagOffset))[tag].name);
+}
+
+int
+PluginCatalog::findTag(const char *name) const
+{
+    if (!m_data) return -1;
+    // Tags are sorted by name index, and so by name
+    int index = findString(name);
+    if (index < 0) return -1;
+    const CatalogHeader *h = (const CatalogHeader *)m_data;
+    const CatalogTag *tags = (const CatalogTag *)at(h->tagOffset);
+    int lo = 0, hi = int(h->tagCount);
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (tags[mid].name == uint32_t(index)) return mid;
+        if (tags[mid].name < uint32_t(index)) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+int
+PluginCatalog::getCandidateCount(int tag) const
+{
+    if (tag < 0 || tag >= getTagCount()) return 0;
+    const CatalogHeader *h = (const CatalogHeader *)m_data;
+    return int(((const CatalogTag *)at(h->tagOffset))[tag].candidateCount);
+}
+
+const char *
+PluginCatalog::getCandidateLibrary(int tag, int index) const
+{
+    if (index < 0 || index >= getCandidateCount(tag)) return nullptr;
+    const CatalogHeader *h = (const CatalogHeader *)m_data;
+    const CatalogTag &t = ((const CatalogTag *)at(h->tagOffset))[tag];
+    return stringAt(((const uint32_t *)at(t.candidateOffset))[index]);
+}
+
+bool
+PluginCatalog::isCandidate(int tag, const char *library) const
+{
+    int count = getCandidateCount(tag);
+    if (count == 0) return false;
+    int index = findString(library);
+    if (index < 0) return false;
+    const CatalogHeader *h = (const CatalogHeader *)m_data;
+    const CatalogTag &t = ((const CatalogTag *)at(h->tagOffset))[tag];
+    const uint32_t *candidates = (const uint32_t *)at(t.candidateOffset);
+    return binary_search(candidates, candidates + count, uint32_t(index));
+}
+
+int
+PluginCatalog::getFailureCount(int tag) const
+{
+    if (tag < 0 || tag >= getTagCount()) return 0;
+    const CatalogHeader *h = (const CatalogHeader *)m_data;
+    return int(((const CatalogTag *)at(h->tagOffset))[tag].failureCount);
+}
+
+PluginCatalog::Failure
+PluginCatalog::getFailure(int tag, int index) const
+{
+    if (index < 0 || index >= getFailureCount(tag)) {
+        return { nullptr, PluginCheckCode::FAIL_OTHER, nullptr };
+    }
+    const CatalogHeader *h = (const CatalogHeader *)m_data;
+    const CatalogTag &t = ((const CatalogTag *)at(h->tagOffset))[tag];
+    const CatalogFailure &f =
+        ((const CatalogFailure *)at(t.failureOffset))[index];
+    return { stringAt(f.library), PluginCheckCode(f.code),
+             stringAt(f.message) };
+}
+
+bool
+PluginCatalog::findFailure(int tag, const char *library,
+                           Failure &failure) const
+{
+    int count = getFailureCount(tag);
+    if (count == 0) return false;
+    int index = findString(library);
+    if (index < 0) return false;
+    const CatalogHeader *h = (const CatalogHeader *)m_data;
+    const CatalogTag &t = ((const CatalogTag *)at(h->tagOffset))[tag];
+    const CatalogFailure *failures =
+        (const CatalogFailure *)at(t.failureOffset);
+    const CatalogFailure *f = lower_bound
+        (failures, failures + count, uint32_t(index),
+         [](const CatalogFailure &a, uint32_t b) { return a.library < b; });
+    if (f == failures + count || f->library != uint32_t(index)) {
+        return false;
+    }
+    failure = { stringAt(f->library), PluginCheckCode(f->code),
+                stringAt(f->message) };
+    return true;
+}
+
+bool
+PluginCatalog::write(string filename,
+                     const CandidateMap &candidates,
+                     const FailureMap &failures)
+{
+    // Gather and number the strings. A set sorts strings by
+    // unsigned byte value, as strcmp() does on reading.
+    
+    set<string> strings;
+    set<string> tagNames;
+    for (const auto &c: candidates) {
+        tagNames.insert(c.first);
+        for (const auto &library: c.second) {
+            strings.insert(library);
+        }
+    }
+    for (const auto &f: failures) {
+        tagNames.insert(f.first);
+        for (const auto &rec: f.second) {
+            strings.insert(rec.library);
+            strings.insert(rec.message);
+        }
+    }
+    strings.insert(tagNames.begin(), tagNames.end());
+
+    map<string, uint32_t> stringIndex;
+    for (const auto &s: strings) {
+        uint32_t n = uint32_t(stringIndex.size());
+        stringIndex[s] = n;
+    }
+
+    // Lay the file out
+
+    CatalogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, catalogMagic, sizeof(catalogMagic));
+    header.formatVersion = catalogFormatVersion;
+    header.byteOrderMark = catalogByteOrderMark;
+    header.tagCount = uint32_t(tagNames.size());
+    header.tagOffset = sizeof(header);
+    header.stringCount = uint32_t(strings.size());
+    header.stringIndexOffset =
+        header.tagOffset + header.tagCount * sizeof(CatalogTag);
+
+    uint64_t offset = header.stringIndexOffset +
+        uint64_t(header.stringCount) * sizeof(uint32_t);
+
+    vector<CatalogTag> tags;
+    vector<vector<uint32_t>> tagCandidates;
+    vector<vector<CatalogFailure>> tagFailures;
+
+    for (const auto &name: tagNames) {
+
+        CatalogTag tag;
+        tag.name = stringIndex[name];
+
+        vector<uint32_t> cc;
+        auto ci = candidates.find(name);
+        if (ci != candidates.end()) {
+            for (const auto &library: ci->second) {
+                cc.push_back(stringIndex[library]);
+            }
+        }
+        sort(cc.begin(), cc.end());
+        cc.erase(unique(cc.begin(), cc.end()), cc.end());
+
+        vector<CatalogFailure> ff;
+        auto fi = failures.find(name);
+        if (fi != failures.end()) {
+            for (const auto &rec: fi->second) {
+                ff.push_back({ stringIndex[rec.library], int32_t(rec.code),
+                               stringIndex[rec.message] });
+            }
+        }
+        sort(ff.begin(), ff.end(),
+             [](const CatalogFailure &a, const CatalogFailure &b) {
+                 return a.library < b.library;
+             });
+        ff.erase(unique(ff.begin(), ff.end(),
+                        [](const CatalogFailure &a, const CatalogFailure &b) {
+                            return a.library == b.library;
+                        }), ff.end());
+
+        tag.candidateCount = uint32_t(cc.size());
+        tag.candidateOffset = uint32_t(offset);
+        offset += cc.size() * sizeof(uint32_t);
+        tag.failureCount = uint32_t(ff.size());
+        tag.failureOffset = uint32_t(offset);
+        offset += ff.size() * sizeof(CatalogFailure);
+
+        tags.push_back(tag);
+        tagCandidates.push_back(cc);
+        tagFailures.push_back(ff);
+    }
+
+    header.stringDataOffset = uint32_t(offset);
+    
+    vector<uint32_t> stringOffsets;
+    for (const auto &s: strings) {
+        stringOffsets.push_back(uint32_t(offset));
+        offset += s.size() + 1;
+    }
+    if (strings.empty()) {
+        offset += 1; // the data must still end with a nul
+    }
+
+    if (offset > UINT32_MAX) {
+        return false;
+    }
+    header.fileSize = uint32_t(offset);
+
+    // Then write it out in that order
+
+    string data;
+    data.reserve(size_t(offset));
+    data.append((const char *)&header, sizeof(header));
+    data.append((const char *)tags.data(), tags.size() * sizeof(CatalogTag));
+    data.append((const char *)stringOffsets.data(),
+                stringOffsets.size() * sizeof(uint32_t));
+    for (size_t t = 0; t < tags.size(); ++t) {
+        data.append((const char *)tagCandidates[t].data(),
+                    tagCandidates[t].size() * sizeof(uint32_t));
+        data.append((const char *)tagFailures[t].data(),
+                    tagFailures[t].size() * sizeof(CatalogFailure));
+    }
+    for (const auto &s: strings) {
+        data.append(s.c_str(), s.size() + 1);
+    }
+    if (strings.empty()) {
+        data.push_back('\0');
+    }
+
+    QSaveFile file(QString::fromUtf8(filename.c_str()));
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    if (file.write(data.c_str(), data.size()) != qint64(data.size())) {
+        file.cancelWriting();
+        return false;
+    }
+    return file.commit();
+}
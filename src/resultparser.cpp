@@ -0,0 +1,212 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#include "resultparser.h"
+#include "helperprotocol.h"
+
+#include <cstring>
+
+using namespace std;
+
+static bool
+isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static void
+trim(const char *&from, const char *&to)
+{
+    while (from < to && isSpace(*from)) ++from;
+    while (to > from && isSpace(to[-1])) --to;
+}
+
+static bool
+equals(const char *from, const char *to, const char *literal)
+{
+    size_t n = strlen(literal);
+    return size_t(to - from) == n && memcmp(from, literal, n) == 0;
+}
+
+ResultParser::ResultParser(Format format) :
+    m_format(format),
+    m_start(0),
+    m_end(0)
+{
+}
+
+char *
+ResultParser::reserve(size_t length)
+{
+    if (m_start == m_end) {
+        m_start = m_end = 0;
+    } else if (m_start > 0 && m_end + length > m_buffer.size()) {
+        // Move the unparsed remainder to the front before growing
+        memmove(m_buffer.data(), m_buffer.data() + m_start, m_end - m_start);
+        m_end -= m_start;
+        m_start = 0;
+    }
+    if (m_end + length > m_buffer.size()) {
+        m_buffer.resize(m_end + length);
+    }
+    return m_buffer.data() + m_end;
+}
+
+void
+ResultParser::commit(size_t length)
+{
+    m_end += length;
+}
+
+ResultParser::Status
+ResultParser::next(Result &result)
+{
+    if (m_format == Format::Binary) {
+        return nextRecord(result);
+    } else {
+        return nextLine(result);
+    }
+}
+
+ResultParser::Status
+ResultParser::nextRecord(Result &result)
+{
+    HelperRecordHeader header;
+    size_t available = m_end - m_start;
+    if (available < sizeof(header)) {
+        return Status::Incomplete;
+    }
+
+    const char *data = m_buffer.data() + m_start;
+    memcpy(&header, data, sizeof(header));
+
+    Kind kind;
+    switch (HelperRecordKind(header.kind)) {
+    case HelperRecordKind::Result: kind = Kind::Verdict; break;
+    case HelperRecordKind::Plugin: kind = Kind::Plugin; break;
+    case HelperRecordKind::Timings: kind = Kind::Timings; break;
+    case HelperRecordKind::Memory: kind = Kind::Memory; break;
+    default: return Status::Corrupt;
+    }
+    
+    if (header.pathLength > helperRecordMaxLength ||
+        header.messageLength > helperRecordMaxLength) {
+        return Status::Corrupt;
+    }
+
+    size_t total = sizeof(header) + header.pathLength + header.messageLength;
+    if (available < total) {
+        return Status::Incomplete;
+    }
+
+    result.kind = kind;
+    result.library = data + sizeof(header);
+    result.libraryLength = header.pathLength;
+    result.code = PluginCheckCode(header.code);
+    result.message = result.library + header.pathLength;
+    result.messageLength = header.messageLength;
+
+    m_start += total;
+    return Status::Parsed;
+}
+
+ResultParser::Status
+ResultParser::nextLine(Result &result)
+{
+    // A line is one of
+    //   SUCCESS|library|
+    //   FAILURE|library|message [code]
+    //   FAILURE|library|[code]
+    // with the code omitted by helpers that predate failure codes.
+    // memchr() is typically vectorised, which makes finding the end
+    // of the line the cheapest part of this.
+    
+    const char *data = m_buffer.data() + m_start;
+    const char *end = (const char *)memchr(data, '\n', m_end - m_start);
+    if (!end) {
+        return Status::Incomplete;
+    }
+    m_start += (end - data) + 1;
+
+    const char *bar1 = (const char *)memchr(data, '|', end - data);
+    if (!bar1) {
+        return Status::Skipped;
+    }
+    const char *library = bar1 + 1;
+    const char *bar2 = (const char *)memchr(library, '|', end - library);
+    const char *libraryEnd = (bar2 ? bar2 : end);
+    const char *message = (bar2 ? bar2 + 1 : end);
+    const char *messageEnd = end;
+    if (!bar2) {
+        trim(library, libraryEnd);
+    } else if (memchr(message, '|', messageEnd - message)) {
+        return Status::Skipped;
+    }
+
+    result.kind = Kind::Verdict;
+    result.library = library;
+    result.libraryLength = libraryEnd - library;
+
+    if (equals(data, bar1, "SUCCESS")) {
+        result.code = PluginCheckCode::SUCCESS;
+        result.message = message;
+        result.messageLength = 0;
+        return Status::Parsed;
+    }
+
+    if (!equals(data, bar1, "FAILURE")) {
+        return Status::Skipped;
+    }
+    
+    trim(message, messageEnd);
+
+    // Look for a trailing [code]
+    PluginCheckCode code = PluginCheckCode::FAIL_OTHER;
+    if (messageEnd > message && messageEnd[-1] == ']') {
+        const char *digits = messageEnd - 1;
+        int value = 0, scale = 1, count = 0;
+        while (digits > message && digits[-1] >= '0' && digits[-1] <= '9' &&
+               count < 9) {
+            --digits;
+            value += (*digits - '0') * scale;
+            scale *= 10;
+            ++count;
+        }
+        if (count > 0 && digits > message && digits[-1] == '[') {
+            code = PluginCheckCode(value);
+            messageEnd = digits - 1;
+            trim(message, messageEnd);
+        }
+    }
+    
+    result.code = code;
+    result.message = message;
+    result.messageLength = messageEnd - message;
+    return Status::Parsed;
+}
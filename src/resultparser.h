@@ -0,0 +1,121 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#ifndef RESULT_PARSER_H
+#define RESULT_PARSER_H
+
+#include "checkcode.h"
+
+#include <vector>
+#include <cstddef>
+
+/**
+ * Incremental parser for the output of the helper, in either its
+ * text format or the binary format of helperprotocol.h.
+ *
+ * Output is read from the helper directly into the parser's buffer,
+ * using reserve() and commit(), and complete results are then taken
+ * from the front of the buffer with next() as soon as they are
+ * available. Results refer to the buffer rather than copying out of
+ * it, and the buffer is reused, so once it has grown large enough to
+ * hold the longest result seen, parsing does no allocation at all.
+ */
+class ResultParser
+{
+public:
+    enum class Format { Text, Binary };
+
+    ResultParser(Format format);
+
+    /** Return a pointer to space for at least the given number of
+     *  bytes at the end of the buffer, for the caller to read into.
+     *  Invalidates any Result previously returned by next().
+     */
+    char *reserve(size_t length);
+
+    /** Mark the given number of bytes, written at the pointer last
+     *  returned by reserve(), as ready to be parsed.
+     */
+    void commit(size_t length);
+
+    enum class Kind {
+        /// The verdict for one descriptor in one library
+        Verdict,
+        /// One plugin found in the library, reported ahead of the
+        /// verdict for its descriptor (binary format only). The code
+        /// is the plugin's version or unique ID, as an integer, and
+        /// the message is its identifier and name separated by a nul
+        Plugin,
+        /// Phase timings for the verdict that follows (binary format
+        /// only). The message is a HelperTimings
+        Timings,
+        /// Memory use around the check of the library whose verdict
+        /// follows (binary format only). The message is a
+        /// HelperMemory
+        Memory
+    };
+
+    /// A verdict or plugin report from the helper. The library and
+    /// message are not nul-terminated.
+    struct Result {
+        Kind kind;
+        const char *library;
+        size_t libraryLength;
+        PluginCheckCode code;
+        const char *message;
+        size_t messageLength;
+    };
+
+    enum class Status {
+        /// A result was parsed and returned
+        Parsed,
+        /// A line that does not contain a result was skipped (text
+        /// format only)
+        Skipped,
+        /// No complete result has been received yet
+        Incomplete,
+        /// The data cannot be parsed any further (binary format only)
+        Corrupt
+    };
+
+    /** Parse the next complete result from the front of the buffer.
+     */
+    Status next(Result &result);
+
+private:
+    Format m_format;
+    std::vector<char> m_buffer;
+    size_t m_start;
+    size_t m_end;
+
+    Status nextLine(Result &result);
+    Status nextRecord(Result &result);
+};
+
+#endif
@@ -0,0 +1,217 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#include "tracer.h"
+
+#include <chrono>
+#include <fstream>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Most events kept, beyond which the oldest are dropped, so that a
+// long-running host with tracing left on doesn't grow without limit
+static const size_t maxTraceEvents = 1000000;
+
+// Thread ID given to the first thread of ours to record an event
+static const int firstThreadId = 1 << 30;
+
+static string
+jsonString(const string &s)
+{
+    string out = "\"";
+    for (unsigned char c: s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+static string
+jsonArgs(const Tracer::Args &args)
+{
+    string out = "{";
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (i > 0) out += ",";
+        out += jsonString(args[i].first) + ":" + jsonString(args[i].second);
+    }
+    return out + "}";
+}
+
+Tracer::Tracer(string filename) :
+    m_filename(filename)
+{
+#ifdef _WIN32
+    m_pid = _getpid();
+#else
+    m_pid = getpid();
+#endif
+    startHelperFile();
+}
+
+long long
+Tracer::now()
+{
+    // The helper times its own events by the same clock
+    return chrono::duration_cast<chrono::microseconds>
+        (chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int
+Tracer::currentThread()
+{
+    lock_guard<mutex> guard(m_mutex);
+    auto id = this_thread::get_id();
+    auto i = m_threads.find(id);
+    if (i != m_threads.end()) {
+        return i->second;
+    }
+    // Numbered from beyond the range of process IDs, which are used
+    // as thread IDs for the helpers' rows
+    int tid = firstThreadId + int(m_threads.size());
+    m_threads[id] = tid;
+    return tid;
+}
+
+void
+Tracer::complete(string name, int tid, long long start, long long end,
+                 Args args)
+{
+    add("{\"name\":" + jsonString(name) +
+        ",\"ph\":\"X\",\"ts\":" + to_string(start) +
+        ",\"dur\":" + to_string(end - start) +
+        ",\"pid\":" + to_string(m_pid) +
+        ",\"tid\":" + to_string(tid) +
+        ",\"args\":" + jsonArgs(args) + "}");
+}
+
+void
+Tracer::instant(string name, int tid, long long time, Args args)
+{
+    add("{\"name\":" + jsonString(name) +
+        ",\"ph\":\"i\",\"s\":\"t\",\"ts\":" + to_string(time) +
+        ",\"pid\":" + to_string(m_pid) +
+        ",\"tid\":" + to_string(tid) +
+        ",\"args\":" + jsonArgs(args) + "}");
+}
+
+void
+Tracer::nameThread(int tid, string name)
+{
+    lock_guard<mutex> guard(m_mutex);
+    m_threadNames[tid] = name;
+}
+
+void
+Tracer::add(string event)
+{
+    lock_guard<mutex> guard(m_mutex);
+    append(event);
+}
+
+void
+Tracer::append(string event)
+{
+    m_events.push_back(event);
+    if (m_events.size() > maxTraceEvents) {
+        m_events.pop_front();
+    }
+}
+
+string
+Tracer::getHelperFile() const
+{
+    return m_filename + ".helper";
+}
+
+void
+Tracer::startHelperFile()
+{
+    // Truncate rather than remove, as helpers kept between scans
+    // still have the file open, and start it as helpers would if
+    // they found it empty, so that they never both do so
+    ofstream(getHelperFile(), ios::out | ios::trunc | ios::binary) << "[\n";
+}
+
+bool
+Tracer::write()
+{
+    lock_guard<mutex> guard(m_mutex);
+
+    // Take in the events helpers have appended since last time,
+    // each on its own line followed by a comma
+    {
+        ifstream helperFile(getHelperFile(), ios::in | ios::binary);
+        string line;
+        while (getline(helperFile, line)) {
+            while (!line.empty() &&
+                   (line.back() == ',' || line.back() == '\r')) {
+                line.pop_back();
+            }
+            if (!line.empty() && line[0] == '{' && line.back() == '}') {
+                append(line);
+            }
+        }
+    }
+    startHelperFile();
+
+    ofstream out(m_filename, ios::out | ios::trunc | ios::binary);
+    if (!out) {
+        return false;
+    }
+
+    out << "{\"traceEvents\":[\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << m_pid
+        << ",\"tid\":0,\"args\":{\"name\":\"PluginCandidates\"}}";
+    for (const auto &t: m_threadNames) {
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << m_pid
+            << ",\"tid\":" << t.first
+            << ",\"args\":{\"name\":" << jsonString(t.second) << "}}";
+    }
+    for (const auto &e: m_events) {
+        out << ",\n" << e;
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    return bool(out);
+}
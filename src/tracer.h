@@ -0,0 +1,160 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
+/**
+ * Collects trace events describing what a scan spent its time on,
+ * and writes them out as a trace-event JSON file of the kind that
+ * chrome://tracing and Perfetto can display.
+ *
+ * Helpers given the --trace option append their own events to a
+ * file alongside (see getHelperFile()), timed by the same monotonic
+ * clock, and write() merges these in so that a single file shows
+ * both sides.
+ *
+ * Tracing is switched off by not having a Tracer at all. Code being
+ * traced holds a possibly-null Tracer pointer, and TraceSpan does
+ * nothing but test it when it is null.
+ *
+ * Thread-safe.
+ */
+class Tracer
+{
+public:
+    /// Names and values of the arguments shown with an event
+    typedef std::vector<std::pair<std::string, std::string>> Args;
+
+    Tracer(std::string filename);
+
+    /** Return the current time in microseconds, on the monotonic
+     *  clock that helpers also use for their events.
+     */
+    static long long now();
+
+    /** Return the trace thread ID for the calling thread.
+     */
+    int currentThread();
+
+    /** Record a span of time on the given thread.
+     */
+    void complete(std::string name, int tid, long long start, long long end,
+                  Args args = {});
+
+    /** Record something happening at a single moment.
+     */
+    void instant(std::string name, int tid, long long time,
+                 Args args = {});
+
+    /** Give a thread a name to be displayed in place of its ID.
+     */
+    void nameThread(int tid, std::string name);
+
+    /** Return the name of the file that helpers should append their
+     *  own events to.
+     */
+    std::string getHelperFile() const;
+
+    /** Take in any events the helpers have written so far, and write
+     *  out the whole trace. Returns false if the file could not be
+     *  written.
+     */
+    bool write();
+
+private:
+    Tracer(const Tracer &) = delete;
+    Tracer &operator=(const Tracer &) = delete;
+
+    std::string m_filename;
+    long long m_pid;
+    std::mutex m_mutex;
+    std::deque<std::string> m_events;
+    std::map<std::thread::id, int> m_threads;
+    std::map<int, std::string> m_threadNames;
+
+    void add(std::string event);
+    void append(std::string event); // with m_mutex held
+    void startHelperFile();
+};
+
+/**
+ * Records a span from its construction until end() is called or it
+ * is destroyed, on the thread that constructed it. Does nothing if
+ * the tracer is null.
+ */
+class TraceSpan
+{
+public:
+    TraceSpan(Tracer *tracer, const char *name) :
+        m_tracer(tracer),
+        m_name(name),
+        m_start(tracer ? Tracer::now() : 0) { }
+
+    ~TraceSpan() {
+        end();
+    }
+
+    /** Set the arguments to be shown with the span. Callers should
+     *  check active() before going to the trouble of building them.
+     */
+    void setArgs(Tracer::Args args) {
+        m_args = args;
+    }
+
+    bool active() const {
+        return m_tracer != nullptr;
+    }
+
+    void end() {
+        if (m_tracer) {
+            m_tracer->complete(m_name, m_tracer->currentThread(),
+                               m_start, Tracer::now(), m_args);
+            m_tracer = nullptr;
+        }
+    }
+
+private:
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+    Tracer *m_tracer;
+    const char *m_name;
+    long long m_start;
+    Tracer::Args m_args;
+};
+
+#endif
@@ -0,0 +1,431 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#include "verdictcache.h"
+
+#include <QFile>
+#include <QSaveFile>
+
+#include <vector>
+
+using namespace std;
+
+static const char *cacheFileMagic = "vamp-plugin-load-checker verdict cache 1";
+
+// Helper version records are distinguished from verdicts by this
+// first field, which can't be a descriptor symbol name, and by their
+// field count, so that readers that don't know about them skip them
+static const char *helperRecordTag = "@helper";
+
+// Plugin records follow the verdict they belong to, and are tagged
+// in the same way
+static const char *pluginRecordTag = "@plugin";
+
+// Crash records likewise
+static const char *crashRecordTag = "@crash";
+
+static string
+escape(string s)
+{
+    string out;
+    for (char c: s) {
+        switch (c) {
+        case '\\': out += "\\\\"; break;
+        case '\t': out += "\\t"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        default: out += c; break;
+        }
+    }
+    return out;
+}
+
+static string
+unescape(string s)
+{
+    string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '\\' && i + 1 < s.size()) {
+            switch (s[++i]) {
+            case 't': out += '\t'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            default: out += s[i]; break;
+            }
+        } else {
+            out += s[i];
+        }
+    }
+    return out;
+}
+
+static vector<string>
+splitFields(const string &line)
+{
+    vector<string> fields;
+    string::size_type index = 0, newindex = 0;
+    while ((newindex = line.find('\t', index)) != string::npos) {
+        fields.push_back(line.substr(index, newindex - index));
+        index = newindex + 1;
+    }
+    fields.push_back(line.substr(index));
+    return fields;
+}
+
+VerdictCache::VerdictCache(string filename) :
+    m_filename(filename),
+    m_modified(false)
+{
+}
+
+bool
+VerdictCache::load()
+{
+    m_entries.clear();
+    m_helpers.clear();
+    m_crashes.clear();
+    m_modified = false;
+    
+    QFile file(QString::fromUtf8(m_filename.c_str()));
+    if (!file.exists()) {
+        return true;
+    }
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QByteArray contents = file.readAll();
+    string text(contents.constData(), contents.size());
+
+    string::size_type index = 0, newindex = 0;
+    bool first = true;
+    Entry *previous = nullptr;
+    
+    while (index < text.size()) {
+
+        newindex = text.find('\n', index);
+        if (newindex == string::npos) newindex = text.size();
+        string line = text.substr(index, newindex - index);
+        index = newindex + 1;
+
+        if (first) {
+            if (line != cacheFileMagic) {
+                return false;
+            }
+            first = false;
+            continue;
+        }
+
+        vector<string> fields = splitFields(line);
+
+        if (fields.size() == 4 && fields[0] == pluginRecordTag) {
+            if (!previous) {
+                continue;
+            }
+            try {
+                previous->plugins.push_back({ unescape(fields[2]),
+                                              unescape(fields[3]),
+                                              stoi(fields[1]) });
+            } catch (const exception &) {
+            }
+            continue;
+        }
+
+        previous = nullptr;
+        
+        if (fields.size() == 7 && fields[0] == helperRecordTag) {
+            HelperEntry entry;
+            try {
+                entry.id.valid = true;
+                entry.id.device = stoull(fields[2]);
+                entry.id.inode = stoull(fields[3]);
+                entry.id.size = stoull(fields[4]);
+                entry.id.mtime = stoll(fields[5]);
+            } catch (const exception &) {
+                continue;
+            }
+            entry.version = unescape(fields[1]);
+            m_helpers[unescape(fields[6])] = entry;
+            continue;
+        }
+
+        if (fields.size() == 11 && fields[0] == crashRecordTag) {
+            CrashRecord record;
+            try {
+                record.id.valid = true;
+                record.id.device = stoull(fields[1]);
+                record.id.inode = stoull(fields[2]);
+                record.id.size = stoull(fields[3]);
+                record.id.mtime = stoll(fields[4]);
+                record.crashes = stoi(fields[5]);
+                record.code = PluginCheckCode(stoi(fields[6]));
+                record.lastCrash = stoll(fields[7]);
+                record.quarantinedUntil = stoll(fields[8]);
+            } catch (const exception &) {
+                continue;
+            }
+            record.message = unescape(fields[10]);
+            m_crashes[unescape(fields[9])] = record;
+            continue;
+        }
+        
+        if (fields.size() != 9) {
+            // Skip anything we don't understand rather than
+            // discarding the lot
+            continue;
+        }
+
+        Entry entry;
+        try {
+            entry.id.valid = true;
+            entry.id.device = stoull(fields[2]);
+            entry.id.inode = stoull(fields[3]);
+            entry.id.size = stoull(fields[4]);
+            entry.id.mtime = stoll(fields[5]);
+            entry.code = PluginCheckCode(stoi(fields[6]));
+        } catch (const exception &) {
+            continue;
+        }
+        entry.helperVersion = unescape(fields[1]);
+        entry.message = unescape(fields[8]);
+        entry.seen = false;
+        
+        previous = &(m_entries[{ unescape(fields[7]), unescape(fields[0]) }]
+                     = entry);
+    }
+
+    return !first;
+}
+
+bool
+VerdictCache::save()
+{
+    for (auto i = m_entries.begin(); i != m_entries.end(); ) {
+        if (!i->second.seen && !FileIdentity::of(i->first.first).valid) {
+            i = m_entries.erase(i);
+            m_modified = true;
+        } else {
+            ++i;
+        }
+    }
+    for (auto i = m_helpers.begin(); i != m_helpers.end(); ) {
+        if (!FileIdentity::of(i->first).valid) {
+            i = m_helpers.erase(i);
+            m_modified = true;
+        } else {
+            ++i;
+        }
+    }
+    for (auto i = m_crashes.begin(); i != m_crashes.end(); ) {
+        if (!FileIdentity::of(i->first).valid) {
+            i = m_crashes.erase(i);
+            m_modified = true;
+        } else {
+            ++i;
+        }
+    }
+
+    if (!m_modified) {
+        return true;
+    }
+    
+    string text = string(cacheFileMagic) + "\n";
+
+    for (const auto &h: m_helpers) {
+        text +=
+            string(helperRecordTag) + "\t" +
+            escape(h.second.version) + "\t" +
+            to_string(h.second.id.device) + "\t" +
+            to_string(h.second.id.inode) + "\t" +
+            to_string(h.second.id.size) + "\t" +
+            to_string(h.second.id.mtime) + "\t" +
+            escape(h.first) + "\n";
+    }
+
+    for (const auto &c: m_crashes) {
+        text +=
+            string(crashRecordTag) + "\t" +
+            to_string(c.second.id.device) + "\t" +
+            to_string(c.second.id.inode) + "\t" +
+            to_string(c.second.id.size) + "\t" +
+            to_string(c.second.id.mtime) + "\t" +
+            to_string(c.second.crashes) + "\t" +
+            to_string(int(c.second.code)) + "\t" +
+            to_string(c.second.lastCrash) + "\t" +
+            to_string(c.second.quarantinedUntil) + "\t" +
+            escape(c.first) + "\t" +
+            escape(c.second.message) + "\n";
+    }
+    
+    for (const auto &e: m_entries) {
+        text +=
+            escape(e.first.second) + "\t" +
+            escape(e.second.helperVersion) + "\t" +
+            to_string(e.second.id.device) + "\t" +
+            to_string(e.second.id.inode) + "\t" +
+            to_string(e.second.id.size) + "\t" +
+            to_string(e.second.id.mtime) + "\t" +
+            to_string(int(e.second.code)) + "\t" +
+            escape(e.first.first) + "\t" +
+            escape(e.second.message) + "\n";
+        for (const auto &p: e.second.plugins) {
+            text +=
+                string(pluginRecordTag) + "\t" +
+                to_string(p.number) + "\t" +
+                escape(p.identifier) + "\t" +
+                escape(p.name) + "\n";
+        }
+    }
+    
+    QSaveFile file(QString::fromUtf8(m_filename.c_str()));
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    if (file.write(text.c_str(), text.size()) != qint64(text.size())) {
+        file.cancelWriting();
+        return false;
+    }
+    if (!file.commit()) {
+        return false;
+    }
+
+    m_modified = false;
+    return true;
+}
+
+bool
+VerdictCache::lookup(string library,
+                     string descriptor,
+                     FileIdentity id,
+                     string helperVersion,
+                     PluginCheckCode &code,
+                     string &message,
+                     PluginList &plugins)
+{
+    auto i = m_entries.find({ library, descriptor });
+    if (i == m_entries.end()) {
+        return false;
+    }
+
+    i->second.seen = true;
+    
+    if (!id.valid ||
+        i->second.id != id ||
+        i->second.helperVersion != helperVersion) {
+        return false;
+    }
+
+    code = i->second.code;
+    message = i->second.message;
+    plugins = i->second.plugins;
+    return true;
+}
+
+void
+VerdictCache::store(string library,
+                    string descriptor,
+                    FileIdentity id,
+                    string helperVersion,
+                    PluginCheckCode code,
+                    string message,
+                    PluginList plugins)
+{
+    if (!id.valid) {
+        return;
+    }
+    
+    m_entries[{ library, descriptor }] =
+        { id, helperVersion, code, message, plugins, true };
+    m_modified = true;
+}
+
+bool
+VerdictCache::lookupHelperVersion(string helper,
+                                  FileIdentity id,
+                                  string &version)
+{
+    auto i = m_helpers.find(helper);
+    if (i == m_helpers.end() || !id.valid || i->second.id != id) {
+        return false;
+    }
+    version = i->second.version;
+    return true;
+}
+
+void
+VerdictCache::storeHelperVersion(string helper,
+                                 FileIdentity id,
+                                 string version)
+{
+    if (!id.valid) {
+        return;
+    }
+
+    auto i = m_helpers.find(helper);
+    if (i != m_helpers.end() &&
+        i->second.id == id && i->second.version == version) {
+        return;
+    }
+    
+    m_helpers[helper] = { id, version };
+    m_modified = true;
+}
+
+bool
+VerdictCache::lookupCrashRecord(string library,
+                                FileIdentity id,
+                                CrashRecord &record)
+{
+    auto i = m_crashes.find(library);
+    if (i == m_crashes.end() || !id.valid || i->second.id != id) {
+        return false;
+    }
+    record = i->second;
+    return true;
+}
+
+void
+VerdictCache::storeCrashRecord(string library,
+                               CrashRecord record)
+{
+    if (!record.id.valid) {
+        return;
+    }
+
+    m_crashes[library] = record;
+    m_modified = true;
+}
+
+void
+VerdictCache::removeCrashRecord(string library)
+{
+    if (m_crashes.erase(library) > 0) {
+        m_modified = true;
+    }
+}
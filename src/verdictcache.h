@@ -0,0 +1,186 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Copyright (c) 2016-2018 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music and Queen Mary, University of London shall not be
+    used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization.
+*/
+
+#ifndef VERDICT_CACHE_H
+#define VERDICT_CACHE_H
+
+#include "fileidentity.h"
+#include "checkcode.h"
+#include "plugincandidates.h"
+
+#include <string>
+#include <map>
+#include <vector>
+
+/**
+ * Persistent record of the helper's verdicts on plugin libraries, so
+ * that unchanged libraries need not be loaded again on every scan.
+ *
+ * Each verdict is keyed by library path and descriptor symbol, and
+ * is only returned if the library's FileIdentity and the helper's
+ * compatibility version both match those recorded with it.
+ *
+ * Each verdict may be followed by the plugins that the helper found
+ * in the library, in the order it reported them.
+ *
+ * The cache also records the compatibility version reported by each
+ * helper executable it has been used with, keyed in the same way by
+ * path and FileIdentity, so that a scan whose verdicts are all
+ * cached need not start the helper at all.
+ *
+ * Finally it keeps a crash record for each library that has crashed
+ * or hung the helper since it last changed, which the scanner uses
+ * to check risky libraries last and to quarantine repeat offenders.
+ *
+ * The cache is a UTF-8 text file with one tab-separated entry per
+ * line. It is read in full by load() and rewritten atomically by
+ * save(). Not thread-safe.
+ */
+class VerdictCache
+{
+public:
+    VerdictCache(std::string filename);
+
+    /** Read the cache file. Returns true if the file was read, or
+     *  did not exist; false if it existed but could not be read or
+     *  was not in a recognised format, in which case the cache is
+     *  left empty.
+     */
+    bool load();
+
+    /** Write the cache file back, if anything has changed since it
+     *  was loaded. Entries for libraries that have not been looked
+     *  up or stored since loading, and that no longer exist, are
+     *  dropped. Returns false if the file could not be written.
+     */
+    bool save();
+
+    typedef std::vector<PluginCandidates::PluginInfo> PluginList;
+
+    /** Look up a verdict. Returns true and sets code, message and
+     *  plugins if a matching entry was found.
+     */
+    bool lookup(std::string library,
+                std::string descriptor,
+                FileIdentity id,
+                std::string helperVersion,
+                PluginCheckCode &code,
+                std::string &message,
+                PluginList &plugins);
+
+    /** Record a verdict, with the plugins the helper reported for
+     *  it, replacing any existing one for the same library and
+     *  descriptor.
+     */
+    void store(std::string library,
+               std::string descriptor,
+               FileIdentity id,
+               std::string helperVersion,
+               PluginCheckCode code,
+               std::string message,
+               PluginList plugins);
+
+    /** Look up the compatibility version recorded for the helper
+     *  executable at the given path. Returns true and sets version
+     *  if the helper is unchanged since it was recorded.
+     */
+    bool lookupHelperVersion(std::string helper,
+                             FileIdentity id,
+                             std::string &version);
+
+    /** Record the compatibility version reported by a helper.
+     */
+    void storeHelperVersion(std::string helper,
+                            FileIdentity id,
+                            std::string version);
+
+    /**
+     * History of a library whose check has crashed or hung the
+     * helper. The record applies only while the library's
+     * FileIdentity is unchanged.
+     */
+    struct CrashRecord {
+        FileIdentity id;
+        int crashes;              // consecutive failed checks
+        PluginCheckCode code;     // verdict from the latest of them
+        std::string message;
+        long long lastCrash;      // seconds since the epoch
+        long long quarantinedUntil; // seconds since the epoch, or 0
+    };
+
+    /** Look up the crash record for a library. Returns true and
+     *  sets record if there is one and the library is unchanged
+     *  since it was made.
+     */
+    bool lookupCrashRecord(std::string library,
+                           FileIdentity id,
+                           CrashRecord &record);
+
+    /** Record, or replace, the crash record for a library.
+     */
+    void storeCrashRecord(std::string library,
+                          CrashRecord record);
+
+    /** Remove any crash record for a library, for example because
+     *  it has since been checked without incident.
+     */
+    void removeCrashRecord(std::string library);
+
+private:
+    struct Entry {
+        FileIdentity id;
+        std::string helperVersion;
+        PluginCheckCode code;
+        std::string message;
+        PluginList plugins;
+        bool seen;
+    };
+
+    // keyed by (library, descriptor)
+    typedef std::map<std::pair<std::string, std::string>, Entry> Entries;
+
+    struct HelperEntry {
+        FileIdentity id;
+        std::string version;
+    };
+
+    // keyed by helper path
+    typedef std::map<std::string, HelperEntry> HelperEntries;
+
+    // keyed by library path
+    typedef std::map<std::string, CrashRecord> CrashRecords;
+
+    std::string m_filename;
+    Entries m_entries;
+    HelperEntries m_helpers;
+    CrashRecords m_crashes;
+    bool m_modified;
+};
+
+#endif
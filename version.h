@@ -1 +1 @@
-#define CHECKER_COMPATIBILITY_VERSION "4"
+#define CHECKER_COMPATIBILITY_VERSION "16"